@@ -13,12 +13,17 @@ void ARemoteStreamingActor::Tick(float DeltaTime)
 {
   Super::Tick(DeltaTime);
   const auto time_since_last_frame = ms_now - frame_update_timestamp;
-  if(time_since_last_frame > 500 && tmp_render_buffers->current_head()->GetData()[0].VoxelCount > 0)
+  // vox_lock_mutex keeps this from publishing concurrently with CopyVoxelsToRenderBuffer, Mailbox only supports one producer at a time
+  if(time_since_last_frame > 500 && vox_lock_mutex.try_lock())
+  {
+    if(RenderBufferHead()->GetData()[0].VoxelCount > 0)
     {
-      for( auto& rb : *tmp_render_buffers->current_head()){
+      for( auto& rb : *RenderBufferHead()){
         rb.VoxelCount = 0;
+      }
+      PublishRenderBuffer();
     }
-    tmp_render_buffers->try_advance_head();
+    vox_lock_mutex.unlock();
   }
 }
 
@@ -7,7 +7,10 @@ void AStreamingActor::EndPlay(const EEndPlayReason::Type EndPlayReason)
 {
   Super::EndPlay(EndPlayReason);
   slides_file_out.close();
+  delete pose_sender;
+  pose_sender = nullptr;
   delete vox_merge;
+  vox_merge = nullptr;
 }
 
 void AStreamingActor::Tick(float DeltaTime)
@@ -15,12 +18,17 @@ void AStreamingActor::Tick(float DeltaTime)
   Super::Tick(DeltaTime);
   if(SendDevicePosesOnTick) SendDevicePoses();
   const auto time_since_last_frame = ms_now - frame_update_timestamp;
-  if(time_since_last_frame > 500 && tmp_render_buffers->current_head()->GetData()[0].VoxelCount > 0)
+  // vox_lock_mutex keeps this from publishing concurrently with CopyVoxelsToRenderBuffer, Mailbox only supports one producer at a time
+  if(time_since_last_frame > 500 && vox_lock_mutex.try_lock())
+  {
+    if(RenderBufferHead()->GetData()[0].VoxelCount > 0)
     {
-      for( auto& rb : *tmp_render_buffers->current_head()){
+      for( auto& rb : *RenderBufferHead()){
         rb.VoxelCount = 0;
+      }
+      PublishRenderBuffer();
     }
-    tmp_render_buffers->try_advance_head();
+    vox_lock_mutex.unlock();
   }
   if(vox_merge && vox_merge->is_recording())
   {
@@ -67,6 +75,14 @@ bool AStreamingActor::InitComponent(FString _VNetIDSuffix)
   char* inst_id;
   auto inst_id_len = vox_merge->get_instance_id(&inst_id);
   InstanceID = FString(ANSI_TO_TCHAR(inst_id));
+  if(SendPosesOffGameThread)
+  {
+    pose_sender = new VIMR::MailboxProcessor<FPoseBatch>([this](FPoseBatch* _b)
+    {
+      if(!vox_merge->send_poses(_b->Poses, _b->Count))
+        UE_LOG(VIMRLog, Warning, TEXT("Failed to send poses"))
+    });
+  }
   vox_merge->set_vox_sink([this](VIMR::VoxelMessage* _v)
   {
     SetHUDText(FString::Printf(TEXT("SRC: %s %hs\nframe:   %lld\nvox size: %.0fmm\nnum vox: %i\nFPS:    %.2f"), 
@@ -150,17 +166,21 @@ void AStreamingActor::SendDevicePoses()
 {
   if(!vox_merge) return;
   if(!NewPoseToSend) return;
-  VIMR::Pose poses[128];
-  int pc = 0;
+  FPoseBatch local_batch;
+  FPoseBatch& batch = pose_sender ? *pose_sender->write_slot() : local_batch;
+  batch.Count = 0;
   for(auto & vrp : VRDevicePoses)
   {
+    if(batch.Count >= UE_ARRAY_COUNT(batch.Poses)) break;
     const auto t = 0.01 * vrp.Value.GetTranslation();
     const auto r = vrp.Value.GetRotation();
     const auto k = static_cast<VIMR::PoseType>(vrp.Key);
-    poses[pc] = VIMR::Pose(ms_now, k, t.X, t.Y, t.Z, r.W, r.X, r.Y, r.Z);
-    pc++;
+    batch.Poses[batch.Count] = VIMR::Pose(ms_now, k, t.X, t.Y, t.Z, r.W, r.X, r.Y, r.Z);
+    batch.Count++;
   }
-  if(!vox_merge->send_poses(poses, pc))
+  if(pose_sender)
+    pose_sender->publish();
+  else if(!vox_merge->send_poses(batch.Poses, batch.Count))
     UE_LOG(VIMRLog, Warning, TEXT("Failed to send poses"))
   NewPoseToSend = false;
 }
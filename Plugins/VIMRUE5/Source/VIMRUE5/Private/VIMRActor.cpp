@@ -86,6 +86,7 @@ void AVIMRActor::BeginPlay()
     }
 
   InitFrameBuffers();
+  if(ShowQueueStats && tmp_render_buffers) tmp_render_buffers->enable_stats(TCHAR_TO_ANSI(*(GetName() + ":Render")));
   //InitVimrComponent();
   Super::BeginPlay();
   n_dumps = 0;
@@ -202,7 +203,7 @@ void AVIMRActor::CopyVoxelsToRenderBuffer(VIMR::VoxelMessage& _v)
     return;
   }
   int render_idx = 0;
-  auto b_tgt = tmp_render_buffers->current_head();
+  auto b_tgt = RenderBufferHead();
   auto t_start = ms_now;
   auto & e = _v.encoding;
   for(auto & bb : *b_tgt){
@@ -250,7 +251,7 @@ void AVIMRActor::CopyVoxelsToRenderBuffer(VIMR::VoxelMessage& _v)
 
   if(!closing)
   {
-    if(!tmp_render_buffers->try_advance_head()){
+    if(!PublishRenderBuffer()){
       //UE_LOG(VIMRLog, Log, TEXT("Render buffers are full"));
     }
   }
@@ -261,19 +262,33 @@ void AVIMRActor::CopyVoxelsToRenderBuffer(VIMR::VoxelMessage& _v)
 
 void AVIMRActor::InitFrameBuffers()
 {
-  tmp_render_buffers = new RingBuffer<TArray<RenderBuffer>>(NumBuffersPerrenderer);
-  for (int i = 0; i < NumBuffersPerrenderer; i++) {
-    current_render_buffer = tmp_render_buffers->current_head();
+  const auto add_render_buffers = [this](TArray<RenderBuffer>* _tgt)
+  {
     for(const auto r : renderers)
     {
-      current_render_buffer->Add(RenderBuffer{});
-      current_render_buffer->Last().CoarsePositionData = new uint8[MAX_RENDERER_VOXELS * VOXEL_TEXTURE_BPP]();
-      current_render_buffer->Last().PositionData = new uint8[MAX_RENDERER_VOXELS * VOXEL_TEXTURE_BPP]();
-      current_render_buffer->Last().ColourData = new uint8[MAX_RENDERER_VOXELS * VOXEL_TEXTURE_BPP]();
-      current_render_buffer->Last().VoxelCount = 0;
-      current_render_buffer->Last().VoxelSizemm = 0;
-      buffers_to_delete.Add(&current_render_buffer->Last());
+      _tgt->Add(RenderBuffer{});
+      _tgt->Last().CoarsePositionData = new uint8[MAX_RENDERER_VOXELS * VOXEL_TEXTURE_BPP]();
+      _tgt->Last().PositionData = new uint8[MAX_RENDERER_VOXELS * VOXEL_TEXTURE_BPP]();
+      _tgt->Last().ColourData = new uint8[MAX_RENDERER_VOXELS * VOXEL_TEXTURE_BPP]();
+      _tgt->Last().VoxelCount = 0;
+      _tgt->Last().VoxelSizemm = 0;
+      buffers_to_delete.Add(&_tgt->Last());
     }
+  };
+  tmp_render_buffers = nullptr;
+  latest_render_buffers = nullptr;
+  if(LatestFrameOnly)
+  {
+    latest_render_buffers = new Mailbox<TArray<RenderBuffer>>();
+    for (size_t i = 0; i < latest_render_buffers->num_slots; i++)
+      add_render_buffers(latest_render_buffers->slot(i));
+    current_render_buffer = latest_render_buffers->read_slot();
+    return;
+  }
+  tmp_render_buffers = new RingBuffer<TArray<RenderBuffer>>(NumBuffersPerrenderer);
+  for (int i = 0; i < NumBuffersPerrenderer; i++) {
+    current_render_buffer = tmp_render_buffers->current_head();
+    add_render_buffers(current_render_buffer);
     tmp_render_buffers->advance_head();
     if(!tmp_render_buffers->tail_advance_blocked()) current_render_buffer = tmp_render_buffers->advance_tail();
   }
@@ -281,8 +296,9 @@ void AVIMRActor::InitFrameBuffers()
 
 void AVIMRActor::DestroyFrameBuffers()
 {
-  tmp_render_buffers->release();
+  if(tmp_render_buffers) tmp_render_buffers->release();
   std::this_thread::sleep_for(std::chrono::milliseconds(800));
+  if(tmp_render_buffers) tmp_render_buffers->disable_stats();
   for(auto & b : buffers_to_delete)
   {
     delete b->CoarsePositionData;
@@ -295,11 +311,34 @@ void AVIMRActor::DestroyFrameBuffers()
 bool AVIMRActor::AdvanceFrameBuffers()
 {
   if(closing) return false;
+  if(latest_render_buffers)
+  {
+    auto * latest = latest_render_buffers->take();
+    if(!latest) return false;
+    current_render_buffer = latest;
+    return true;
+  }
   if(tmp_render_buffers->tail_advance_blocked()) return false;
   current_render_buffer = tmp_render_buffers->advance_tail();
   return true;
 }
 
+TArray<RenderBuffer>* AVIMRActor::RenderBufferHead()
+{
+  if(latest_render_buffers) return latest_render_buffers->write_slot();
+  return tmp_render_buffers->current_head();
+}
+
+bool AVIMRActor::PublishRenderBuffer()
+{
+  if(latest_render_buffers)
+  {
+    latest_render_buffers->publish();
+    return true;
+  }
+  return tmp_render_buffers->try_advance_head();
+}
+
 void AVIMRActor::UpdateVoxelPos()
 {
 
@@ -320,6 +359,18 @@ void AVIMRActor::SetHUDText(FString msg)
   CurrentHudText = msg;
 }
 
+FString AVIMRActor::QueueStatsHudText() const
+{
+  FString res;
+  for(const auto & q : VIMR::QueueStatsRegistry::snapshot())
+  {
+    res += FString::Printf(TEXT("\n%s: in %llu out %llu drop %llu, busy %.0fms idle %.0fms"), ANSI_TO_TCHAR(q.name.c_str()),
+      (unsigned long long)q.n_in, (unsigned long long)q.n_out, (unsigned long long)q.n_dropped,
+      q.processing_ns * 1e-6, q.consumer_idle_ns * 1e-6);
+  }
+  return res;
+}
+
 void AVIMRActor::GetVRDevicePoses()
 {
   if(GEngine->XRSystem){
@@ -364,7 +415,7 @@ void AVIMRActor::Tick(float DeltaTime)
   AdvanceFrameBuffers();
   if(hud) hud->ShowHUDText = ShowHUDText;
   if(ShowHUDText && hud){
-    hud->AddHudText(UID, CurrentHudText);
+    hud->AddHudText(UID, ShowQueueStats ? CurrentHudText + QueueStatsHudText() : CurrentHudText);
   }
   //GetVRDevicePoses();
   UpdateVoxelPos();
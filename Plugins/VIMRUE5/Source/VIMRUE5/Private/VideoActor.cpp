@@ -8,6 +8,13 @@
 #include <fstream>
 #include "Engine.h"
 #include "VIMRUE5.h"
+#if PLATFORM_WINDOWS
+#include "Windows/AllowWindowsPlatformTypes.h"
+#endif
+#include "VIMR/threads.hpp"
+#if PLATFORM_WINDOWS
+#include "Windows/HideWindowsPlatformTypes.h"
+#endif
 
 using namespace VIMR;
 
@@ -71,8 +78,10 @@ void AVideoActor::Tick(float DeltaTime)
 
     if(Play && player->state() != VoxVidPlayer::PlayState::Playing){
       UE_LOG(VIMRLog, Log, TEXT("Playing"));
-      if(player->play())
+      if(player->play()){
+        ApplyThreadConfig(player->get_play_thread(), "vimr-vid-play", PlayThreadCores, PlayThreadPriority);
         for (auto& astrm : as) astrm->Resume();
+      }
     }
 
     if(!Play && player->state() == VoxVidPlayer::PlayState::Playing){
@@ -96,6 +105,16 @@ void AVideoActor::Tick(float DeltaTime)
   }
 }
 
+void AVideoActor::ApplyThreadConfig(std::thread& _thread, const char* _name, const TArray<int32>& _cores, int _priority)
+{
+  VIMR::ThreadConfig tc;
+  tc.name = _name;
+  for(const auto c : _cores) tc.cores.push_back(c);
+  tc.priority = _priority;
+  if(!VIMR::apply_thread_config(_thread, tc))
+    UE_LOG(VIMRLog, Warning, TEXT("Failed to apply some thread settings to %s, see the VIMR log"), ANSI_TO_TCHAR(_name));
+}
+
 void AVideoActor::finished_Implementation(bool Looped)
 {
   Play = Looped;
@@ -232,6 +251,7 @@ if(VoxvidRootPath.IsEmpty())
   }
   else
   {
+    ApplyThreadConfig(players[VX5Path]->get_load_thread(), "vimr-vid-load", LoadThreadCores, LoadThreadPriority);
     UE_LOG(VIMRLog, Log, TEXT("Loading VoxelVideo - started loading file: %s"), *VX5FullPath);
     SetHUDText(FString::Printf(TEXT("Started loading file: %s"), *VX5FullPath));
     VideoTitle = FString(ANSI_TO_TCHAR(players[VX5Path]->metadata.title));
@@ -8,6 +8,13 @@
 #include <iostream>
 #include "StreamingActor.generated.h"
 
+// Device poses from one tick, handed to the pose sender thread
+struct FPoseBatch
+{
+  VIMR::Pose Poses[128];
+  int Count = 0;
+};
+
 /**
  * 
  */
@@ -31,6 +38,11 @@ public:
   UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "VIMRStream")
   bool NewPoseToSend = false; 
 
+  // Send poses from a separate thread instead of the game thread. Only the newest poses are sent if
+  // sending can't keep up. Takes effect on InitComponent.
+  UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "VIMRStream")
+  bool SendPosesOffGameThread = false;
+
   UFUNCTION(BlueprintCallable, Category = "VIMRStream")
  	bool InitComponent(FString _VNetIDSuffix = "");
 
@@ -53,5 +65,6 @@ public:
 protected:
   virtual void BeginPlay() override;
   VIMR::VoxMergeUESafe *vox_merge = nullptr;
+  VIMR::MailboxProcessor<FPoseBatch> *pose_sender = nullptr;
   std::ofstream slides_file_out;
 };
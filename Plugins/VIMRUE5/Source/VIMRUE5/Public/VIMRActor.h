@@ -19,6 +19,7 @@
 using VIMR::VoxelMessage;
 using VIMR::RenderBuffer;
 using VIMR::RingBuffer;
+using VIMR::Mailbox;
 
 UCLASS()
 class VIMRUE5_API AVIMRActor : public AActor, public IVoxelSourceInterface
@@ -84,6 +85,16 @@ public:
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "VIMR")
 	USoundAttenuation * DefaultSoundAttenuation;
 
+	// Always render the newest received frame instead of queueing frames, frames which arrive faster than
+	// the render rate are dropped instead of being delayed. Takes effect on BeginPlay.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "VIMR")
+	bool LatestFrameOnly = false;
+
+	// Count the frames going through the render queue and add the counters of every queue in the process which
+	// has stats enabled (see VIMR::QueueStatsRegistry) to the HUD text. Takes effect on BeginPlay.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "VIMR")
+	bool ShowQueueStats = false;
+
 	UPROPERTY()
   int n_dumps = 0;
 
@@ -115,7 +126,8 @@ public:
 	TArray<UVoxelRenderComponent*> renderers;
 protected:
 	void CopyVoxelsToRenderBuffer(VIMR::VoxelMessage& _v);
-	RingBuffer<TArray<RenderBuffer>> * tmp_render_buffers;
+	RingBuffer<TArray<RenderBuffer>> * tmp_render_buffers = nullptr;
+	Mailbox<TArray<RenderBuffer>> * latest_render_buffers = nullptr;
 	TArray<RenderBuffer> * current_render_buffer;
 	TArray<RenderBuffer*> buffers_to_delete;
 
@@ -124,10 +136,16 @@ protected:
 	void InitFrameBuffers();
   void DestroyFrameBuffers();
   bool AdvanceFrameBuffers();
+  // The buffer which the next frame should be copied to, from whichever of tmp_render_buffers/latest_render_buffers is in use
+  TArray<RenderBuffer> * RenderBufferHead();
+  // Hand the head buffer to the renderer, false if the frame was dropped
+  bool PublishRenderBuffer();
 
 	void UpdateVoxelPos();
 
 	void SetHUDText(FString msg);
+	// One line per queue in VIMR::QueueStatsRegistry
+	FString QueueStatsHudText() const;
 
 	std::mutex vox_lock_mutex;
 
@@ -46,6 +46,18 @@ public:
 	// How many frames to keep in the buffer (larger = longer time to open video file, but frame rate will be higher)
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "VIMRVideo")
 	int BufferSize = 30;
+	// CPU cores for the thread which plays each video (empty = any core), applied whenever playback starts
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "VIMRVideo")
+	TArray<int32> PlayThreadCores;
+	// Priority of the playback thread relative to normal: -2 (idle) .. 0 (normal) .. 2 (time critical)
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "VIMRVideo", meta = (ClampMin = "-2", ClampMax = "2"))
+	int PlayThreadPriority = 0;
+	// CPU cores for the thread which loads and decodes frames (empty = any core), applied when a video is opened
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "VIMRVideo")
+	TArray<int32> LoadThreadCores;
+	// Priority of the loading thread, same range as PlayThreadPriority
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "VIMRVideo", meta = (ClampMin = "-2", ClampMax = "2"))
+	int LoadThreadPriority = 0;
   // Sets a video as active, will attempt to load the video if it is not already.
 	UFUNCTION(BlueprintCallable, Category = "VIMRVideo")
 	bool SetActive(const FString & VX5Path);
@@ -75,6 +87,8 @@ protected:
 	bool end_next_tick = false;
 	bool buffering_completed = false;
   virtual void BeginPlay() override;
+  // Name, cores and priority for one of a player's threads (see VIMR::apply_thread_config())
+  static void ApplyThreadConfig(std::thread& _thread, const char* _name, const TArray<int32>& _cores, int _priority);
   std::map<FString, VIMR::VoxVidPlayer*> players;
 	std::map<FString, TArray<UAudioSource*>> AudioStreams;
 	std::map<FString, TArray<std::pair<int,int>>> slidetimes;
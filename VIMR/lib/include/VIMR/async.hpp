@@ -1,16 +1,39 @@
 #pragma once
 
 #include <mutex>
+#include <atomic>
 #include <chrono>
 #include <thread>
 #include <string>
 #include <functional>
 #include <condition_variable>
 #include <utility>
+#include <cstdint>
+#include <algorithm>
 #include <iostream>
+#include "executor.hpp"
+#include "queue_stats.hpp"
+#include "eventcount.hpp"
+#include "side_table.hpp"
 
 namespace VIMR
 {
+	/*
+	 * RingBuffer state that doesn't fit in its layout (which the prebuilt library fixes), see SideTable
+	 */
+	struct RingBufferHooks
+	{
+		std::function<void(void)> on_head_advanced{ []() {} };
+		QueueStats* stats{};
+
+		~RingBufferHooks()
+		{
+			if (!stats) return;
+			QueueStatsRegistry::remove(stats);
+			delete stats;
+		}
+	};
+
 	/*
 	 * A thread-safe which supports producer-consumer pipelines which can either aim to minimise latency or minimise data loss
 	 */
@@ -43,8 +66,7 @@ namespace VIMR
 				release = [this]()
 				{
 					is_released = true;
-					cond_full.notify_one();
-					cond_empty.notify_one();
+					wake_all();
 				};
 				q_size = _size;
 				if (q_size < 3) throw std::exception();
@@ -56,7 +78,7 @@ namespace VIMR
 			~RingBuffer()
 			{
 				release();
-
+				SideTable<RingBufferHooks>::erase(this, buffer);
 				//delete[] buffer;
 			}
 
@@ -68,11 +90,22 @@ namespace VIMR
 			 */
 			void advance_head()
 			{
-				std::unique_lock<std::mutex> cond_sig_lock(cond_signal_mutex);
-				cond_full.wait(cond_sig_lock, [this]()
-				{ return !this->head_advance_blocked() || this->is_released; });
-				head_idx++;
+				auto* hooks = find_hooks();
+				QueueStats* const stats = hooks ? hooks->stats : nullptr;
+				const uint64_t t_wait = (stats && this->head_advance_blocked()) ? QueueStats::now_ns() : 0;
+				{
+					std::unique_lock<std::mutex> cond_sig_lock(cond_signal_mutex);
+					cond_full.wait(cond_sig_lock, [this]()
+					{ return !this->head_advance_blocked() || this->is_released; });
+					head_idx++;
+					if (stats)
+					{
+						if (t_wait) stats->on_blocked(QueueStats::now_ns() - t_wait);
+						stats->on_in(head_idx - tail_idx);
+					}
+				}
 				cond_empty.notify_one();
+				if (hooks) hooks->on_head_advanced();
 			}
 
 			/*
@@ -82,7 +115,11 @@ namespace VIMR
 			 */
 			bool try_advance_head()
 			{
-				if (this->head_advance_blocked()) return false;
+				if (this->head_advance_blocked())
+				{
+					if (QueueStats* stats = find_stats()) stats->on_drop();
+					return false;
+				}
 				advance_head();
 				return true;
 			}
@@ -114,10 +151,16 @@ namespace VIMR
 			 */
 			T* advance_tail()
 			{
-				std::unique_lock<std::mutex> cond_sig_lock(cond_signal_mutex);
-				cond_empty.wait(cond_sig_lock, [this]()
-				{ return !this->tail_advance_blocked() || this->is_released; });
-				T* x = &(buffer[tail_idx++ % q_size]);
+				QueueStats* const stats = find_stats();
+				const uint64_t t_wait = (stats && this->tail_advance_blocked()) ? QueueStats::now_ns() : 0;
+				T* x;
+				{
+					std::unique_lock<std::mutex> cond_sig_lock(cond_signal_mutex);
+					cond_empty.wait(cond_sig_lock, [this]()
+					{ return !this->tail_advance_blocked() || this->is_released; });
+					x = &(buffer[tail_idx++ % q_size]);
+					if (stats) on_tail_advanced(stats, t_wait);
+				}
 				cond_full.notify_one();
 				return x;
 			}
@@ -129,19 +172,67 @@ namespace VIMR
 			 */
 			T* advance_tail(unsigned long _timeout_ms)
 			{
-				std::unique_lock<std::mutex> cond_sig_lock(cond_signal_mutex);
-				if (!cond_empty.wait_for(cond_sig_lock, std::chrono::milliseconds(_timeout_ms), [this]()
-				{ return !this->tail_advance_blocked() || this->is_released; }))
-					return nullptr;
-				T* x = &(buffer[tail_idx++ % q_size]);
+				QueueStats* const stats = find_stats();
+				const uint64_t t_wait = (stats && this->tail_advance_blocked()) ? QueueStats::now_ns() : 0;
+				T* x;
+				{
+					std::unique_lock<std::mutex> cond_sig_lock(cond_signal_mutex);
+					if (!cond_empty.wait_for(cond_sig_lock, std::chrono::milliseconds(_timeout_ms), [this]()
+					{ return !this->tail_advance_blocked() || this->is_released; }))
+					{
+						if (t_wait) stats->on_idle(QueueStats::now_ns() - t_wait);
+						return nullptr;
+					}
+					x = &(buffer[tail_idx++ % q_size]);
+					if (stats) on_tail_advanced(stats, t_wait);
+				}
 				cond_full.notify_one();
 				return x;
 			}
 
+			/*
+			 * Batched version of advance_tail(). Blocks until at least one element is occupied (or release() is
+			 * called), then sets _first to the oldest occupied element and returns how many occupied elements follow
+			 * it contiguously in memory (at most _max, stopping where the buffer wraps). Returns 0 if released.
+			 *
+			 * The elements belong to the consumer until release_tail_batch() is called with the same count, which
+			 * must happen before the next call to acquire_tail_batch()/advance_tail().
+			 */
+			size_t acquire_tail_batch(T*& _first, size_t _max = SIZE_MAX)
+			{
+				QueueStats* const stats = find_stats();
+				const uint64_t t_wait = (stats && this->tail_advance_blocked()) ? QueueStats::now_ns() : 0;
+				std::unique_lock<std::mutex> cond_sig_lock(cond_signal_mutex);
+				cond_empty.wait(cond_sig_lock, [this]()
+				{ return !this->tail_advance_blocked() || this->is_released; });
+				if (t_wait) stats->on_idle(QueueStats::now_ns() - t_wait);
+				if (this->tail_advance_blocked()) return 0;
+				const size_t t = tail_idx;
+				_first = &(buffer[t % q_size]);
+				return std::min({ head_idx - t, q_size - (t % q_size), _max });
+			}
+			/*
+			 * Hand _n elements returned by acquire_tail_batch() back to the producer in one go.
+			 * The last of them stays valid as the current tail, the same as after advance_tail().
+			 */
+			void release_tail_batch(size_t _n)
+			{
+				if (!_n) return;
+				{
+					std::lock_guard<std::mutex> cond_sig_lock(cond_signal_mutex);
+					tail_idx += _n;
+					if (QueueStats* stats = find_stats()) stats->on_out(_n);
+				}
+				cond_full.notify_all();
+			}
+
 			/*
 			 * If the next tail element is occupied, return a pointer to that element otherwise return nullptr.
 			 * Does not advance the tail of the buffer.
 			 * Will never block
+			 *
+			 * Note this indexes (tail_idx + 1), i.e. one past the element the next advance_tail() returns.
+			 * SPSCRingBuffer::peek_tail() returns that element itself.
 			 */
 			T* peek_tail()
 			{
@@ -168,64 +259,699 @@ namespace VIMR
 			}
 			std::function<void(void)> release;
 
+			/*
+			 * Stays the same for the lifetime of the buffer and is never used by another buffer, e.g. as the instance
+			 * key of a SideTable entry
+			 */
+			const void* instance_key() const
+			{
+				return buffer;
+			}
+
+			/*
+			 * _f is called by the producer thread after every successful head advance.
+			 * Set it before any thread uses the buffer.
+			 */
+			void set_on_head_advanced(std::function<void(void)> _f)
+			{
+				SideTable<RingBufferHooks>::get(this, buffer)->on_head_advanced = std::move(_f);
+			}
+
+			/*
+			 * Start counting items, drops, occupancy and wait times for this buffer and add it to
+			 * QueueStatsRegistry under _name. Call before any thread uses the buffer.
+			 *
+			 * Only calls made through these headers are counted. A buffer which is destroyed by the prebuilt
+			 * library stays in the registry until another buffer is created at its address.
+			 */
+			void enable_stats(const std::string& _name)
+			{
+				auto* hooks = SideTable<RingBufferHooks>::get(this, buffer);
+				if (hooks->stats) return;
+				hooks->stats = new QueueStats(_name, q_size);
+				QueueStatsRegistry::add(hooks->stats);
+			}
+			/*
+			 * Not thread safe, only call when neither side is using the buffer
+			 */
+			void disable_stats()
+			{
+				auto* hooks = find_hooks();
+				if (!hooks || !hooks->stats) return;
+				QueueStatsRegistry::remove(hooks->stats);
+				delete hooks->stats;
+				hooks->stats = nullptr;
+			}
+			/*
+			 * nullptr unless enable_stats() was called
+			 */
+			const QueueStats* get_stats() const
+			{
+				return find_stats();
+			}
+
 			void reset()
 			{
 				head_idx = 0;
 				tail_idx = 0;
 			}
+	 protected:
+			void wake_all()
+			{
+				// So that a thread which has just seen is_released == false is already waiting when notified
+				{
+					std::lock_guard<std::mutex> cond_sig_lock(cond_signal_mutex);
+				}
+				cond_full.notify_all();
+				cond_empty.notify_all();
+			}
+			RingBufferHooks* find_hooks() const
+			{
+				return SideTable<RingBufferHooks>::find(this, buffer);
+			}
+			QueueStats* find_stats() const
+			{
+				auto* hooks = find_hooks();
+				return hooks ? hooks->stats : nullptr;
+			}
+			static void on_tail_advanced(QueueStats* _stats, uint64_t _t_wait)
+			{
+				if (_t_wait) _stats->on_idle(QueueStats::now_ns() - _t_wait);
+				_stats->on_out();
+			}
 	};
 
 	/*
-	 * An extension of RingBuffer which manages a consumer thread
+	 * Single-producer/single-consumer version of RingBuffer with the same interface and the same blocking and
+	 * release() semantics. Exactly one thread may call the head functions and exactly one thread may call the
+	 * tail functions.
+	 *
+	 * The indices are atomics on separate cache lines, so the producer and consumer never take a lock while
+	 * the buffer is neither full nor empty. A blocked thread spins for a short while before it parks on an
+	 * EventCount, and the other side only makes a syscall if somebody is actually parked.
 	 */
 	template<class T>
-	class BufferProcessor : public RingBuffer<T>
+	class SPSCRingBuffer
+	{
+	 protected:
+			static constexpr size_t cache_line = 64;
+			static constexpr int spin_iters = 2000;
+			alignas(cache_line) std::atomic<size_t> head_idx{ 0 };
+			alignas(cache_line) std::atomic<size_t> tail_idx{ 0 };
+			alignas(cache_line) std::atomic<bool> is_released{ false };
+			EventCount parked;
+			size_t q_size;
+			T* buffer;
+			QueueStats* stats{};
+			std::function<void(void)> on_head_advanced{};
+
+			template<class PRED_T>
+			void park(PRED_T _ready)
+			{
+				parked.await([&]()
+				{ return _ready() || is_released.load(std::memory_order_acquire); }, spin_iters);
+			}
+			template<class PRED_T>
+			bool park_for(PRED_T _ready, unsigned long _timeout_ms)
+			{
+				return parked.await_for([&]()
+				{ return _ready() || is_released.load(std::memory_order_acquire); }, _timeout_ms, spin_iters);
+			}
+			void unpark()
+			{
+				// Only a fence and a load unless the other side is parked
+				parked.notify_all();
+			}
+			void wake_all()
+			{
+				parked.notify_all();
+			}
+			QueueStats* find_stats() const
+			{
+				return stats;
+			}
+			static void on_tail_advanced(QueueStats* _stats, uint64_t _t_wait)
+			{
+				if (_t_wait) _stats->on_idle(QueueStats::now_ns() - _t_wait);
+				_stats->on_out();
+			}
+	 public:
+			size_t size() const
+			{
+				return q_size;
+			}
+			size_t num_used() const
+			{
+				return head_idx.load(std::memory_order_acquire) - tail_idx.load(std::memory_order_acquire);
+			}
+			/*
+			 * _size >= 3
+			 */
+			explicit SPSCRingBuffer(size_t _size)
+			{
+				release = [this]()
+				{
+					is_released.store(true, std::memory_order_release);
+					wake_all();
+				};
+				q_size = _size;
+				if (q_size < 3) throw std::exception();
+				buffer = new T[q_size]{};
+			}
+			/*
+			 * Make sure to call release() and to join() any threads using the buffer before destruction.
+			 */
+			~SPSCRingBuffer()
+			{
+				release();
+				disable_stats();
+			}
+
+			/*
+			 * Producer only. Same as RingBuffer::advance_head()
+			 */
+			void advance_head()
+			{
+				const uint64_t t_wait = (stats && head_advance_blocked()) ? QueueStats::now_ns() : 0;
+				park([this]()
+				{ return !this->head_advance_blocked(); });
+				head_idx.store(head_idx.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+				unpark();
+				if (stats)
+				{
+					if (t_wait) stats->on_blocked(QueueStats::now_ns() - t_wait);
+					stats->on_in(num_used());
+				}
+				if (on_head_advanced) on_head_advanced();
+			}
+			/*
+			 * Producer only. Same as RingBuffer::try_advance_head()
+			 */
+			bool try_advance_head()
+			{
+				if (head_advance_blocked())
+				{
+					if (stats) stats->on_drop();
+					return false;
+				}
+				head_idx.store(head_idx.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+				unpark();
+				if (stats) stats->on_in(num_used());
+				if (on_head_advanced) on_head_advanced();
+				return true;
+			}
+			/*
+			 * Producer only. Same as RingBuffer::current_head()
+			 */
+			T* current_head()
+			{
+				return &(buffer[head_idx.load(std::memory_order_relaxed) % q_size]);
+			}
+			/*
+			 * Consumer only. Same as RingBuffer::current_tail()
+			 */
+			T* current_tail()
+			{
+				return &(buffer[tail_idx.load(std::memory_order_relaxed) % q_size]);
+			}
+			/*
+			 * Consumer only. Same as RingBuffer::advance_tail()
+			 */
+			T* advance_tail()
+			{
+				const uint64_t t_wait = (stats && tail_advance_blocked()) ? QueueStats::now_ns() : 0;
+				park([this]()
+				{ return !this->tail_advance_blocked(); });
+				const size_t t = tail_idx.load(std::memory_order_relaxed);
+				T* x = &(buffer[t % q_size]);
+				tail_idx.store(t + 1, std::memory_order_release);
+				unpark();
+				if (stats) on_tail_advanced(stats, t_wait);
+				return x;
+			}
+			/*
+			 * Consumer only. Same as RingBuffer::advance_tail(_timeout_ms)
+			 */
+			T* advance_tail(unsigned long _timeout_ms)
+			{
+				const uint64_t t_wait = (stats && tail_advance_blocked()) ? QueueStats::now_ns() : 0;
+				if (!park_for([this]()
+				{ return !this->tail_advance_blocked(); }, _timeout_ms))
+				{
+					if (t_wait) stats->on_idle(QueueStats::now_ns() - t_wait);
+					return nullptr;
+				}
+				const size_t t = tail_idx.load(std::memory_order_relaxed);
+				T* x = &(buffer[t % q_size]);
+				tail_idx.store(t + 1, std::memory_order_release);
+				unpark();
+				if (stats) on_tail_advanced(stats, t_wait);
+				return x;
+			}
+			/*
+			 * Consumer only. Same as RingBuffer::acquire_tail_batch()
+			 */
+			size_t acquire_tail_batch(T*& _first, size_t _max = SIZE_MAX)
+			{
+				const uint64_t t_wait = (stats && tail_advance_blocked()) ? QueueStats::now_ns() : 0;
+				park([this]()
+				{ return !this->tail_advance_blocked(); });
+				if (t_wait) stats->on_idle(QueueStats::now_ns() - t_wait);
+				if (tail_advance_blocked()) return 0;
+				const size_t t = tail_idx.load(std::memory_order_relaxed);
+				_first = &(buffer[t % q_size]);
+				return std::min({ head_idx.load(std::memory_order_acquire) - t, q_size - (t % q_size), _max });
+			}
+			/*
+			 * Consumer only. Same as RingBuffer::release_tail_batch()
+			 */
+			void release_tail_batch(size_t _n)
+			{
+				if (!_n) return;
+				tail_idx.store(tail_idx.load(std::memory_order_relaxed) + _n, std::memory_order_release);
+				unpark();
+				if (stats) stats->on_out(_n);
+			}
+			/*
+			 * Consumer only. If the next tail element is occupied, return a pointer to it, otherwise nullptr.
+			 * Does not advance the tail of the buffer. Will never block.
+			 *
+			 * Unlike RingBuffer::peek_tail() this returns the element the next advance_tail() will return
+			 * (buffer[tail_idx]), not the one after it, so it is never the unwritten head slot.
+			 */
+			T* peek_tail()
+			{
+				if (tail_advance_blocked()) return nullptr;
+				return &(buffer[tail_idx.load(std::memory_order_relaxed) % q_size]);
+			}
+			bool head_advance_blocked() const
+			{
+				// See RingBuffer::head_advance_blocked() for the extra '-1'
+				return (head_idx.load(std::memory_order_relaxed) + 1) >= (q_size + tail_idx.load(std::memory_order_acquire) - 1);
+			}
+			bool tail_advance_blocked() const
+			{
+				return tail_idx.load(std::memory_order_relaxed) >= head_idx.load(std::memory_order_acquire);
+			}
+			bool released()
+			{
+				return is_released.load(std::memory_order_acquire);
+			}
+			std::function<void(void)> release;
+
+			/*
+			 * Same as RingBuffer::instance_key()
+			 */
+			const void* instance_key() const
+			{
+				return buffer;
+			}
+
+			/*
+			 * Same as RingBuffer::set_on_head_advanced()
+			 */
+			void set_on_head_advanced(std::function<void(void)> _f)
+			{
+				on_head_advanced = std::move(_f);
+			}
+
+			/*
+			 * Same as RingBuffer::enable_stats()
+			 */
+			void enable_stats(const std::string& _name)
+			{
+				if (stats) return;
+				stats = new QueueStats(_name, q_size);
+				QueueStatsRegistry::add(stats);
+			}
+			/*
+			 * Same as RingBuffer::disable_stats()
+			 */
+			void disable_stats()
+			{
+				if (!stats) return;
+				QueueStatsRegistry::remove(stats);
+				delete stats;
+				stats = nullptr;
+			}
+			const QueueStats* get_stats() const
+			{
+				return stats;
+			}
+
+			/*
+			 * Not thread safe, only call when neither side is using the buffer
+			 */
+			void reset()
+			{
+				head_idx = 0;
+				tail_idx = 0;
+			}
+	};
+
+	/*
+	 * An extension of RingBuffer which manages a consumer thread
+	 *
+	 * RING_T can be SPSCRingBuffer<T> if there is only ever one producer thread.
+	 *
+	 * If an Executor is given then no thread is created, instead the buffer is drained by tasks on the
+	 * executor. There is never more than one drain task in flight for a BufferProcessor so elements are
+	 * still processed one at a time and in order. The executor must outlive the BufferProcessor.
+	 *
+	 * With a BatchProcessFunction the callback gets every element that is available (as a contiguous span, so
+	 * a batch ends where the buffer wraps) and they are all handed back to the producer after it returns.
+	 * The lock/wakeup cost is then per batch instead of per element.
+	 *
+	 * The members are the ones the prebuilt library was built with, so the executor and batch state lives in
+	 * the consumer thread and in the release()/head-advance closures instead.
+	 */
+	template<class T, class RING_T = RingBuffer<T>>
+	class BufferProcessor : public RING_T
 	{
 	 public:
 			typedef std::function<void(T*)> ProcessFunction;
+			typedef std::function<void(T*, size_t)> BatchProcessFunction;
+
+			/*
+			 * If _stats_name is given then enable_stats(_stats_name) is called before the consumer starts
+			 */
+			BufferProcessor(size_t _size, ProcessFunction _process_function, const char* _stats_name = nullptr) : RING_T(_size)
+			{
+				if (_stats_name) this->enable_stats(_stats_name);
+				process_function = _process_function;
+				start_thread(BatchProcessFunction{});
+			}
+			BufferProcessor(size_t _size, ProcessFunction _process_function, Executor* _executor, const char* _stats_name = nullptr) : RING_T(_size)
+			{
+				if (_stats_name) this->enable_stats(_stats_name);
+				process_function = _process_function;
+				start_drain(_executor, BatchProcessFunction{});
+			}
+			BufferProcessor(size_t _size, BatchProcessFunction _batch_function, const char* _stats_name = nullptr) : RING_T(_size)
+			{
+				if (_stats_name) this->enable_stats(_stats_name);
+				start_thread(std::move(_batch_function));
+			}
+			BufferProcessor(size_t _size, BatchProcessFunction _batch_function, Executor* _executor, const char* _stats_name = nullptr) : RING_T(_size)
+			{
+				if (_stats_name) this->enable_stats(_stats_name);
+				start_drain(_executor, std::move(_batch_function));
+			}
+			/*
+			 * The consumer thread, not joinable if the processor runs on an Executor.
+			 * Use with apply_thread_config() from threads.hpp.
+			 */
+			std::thread& processing_thread()
+			{
+				return process_thread;
+			}
+			~BufferProcessor()
+			{
+				// Joins the consumer thread, or waits for the last drain task
+				this->release();
+//				delete[] buffer;
+			}
+	 private:
+			// Max number of elements processed by one executor task before it yields to other tasks
+			static constexpr size_t drain_budget = 32;
+			ProcessFunction process_function;
+			std::thread process_thread;
+
+			/*
+			 * Shared by the release() and head-advance closures and the drain task in flight
+			 */
+			struct Drain
+			{
+				Executor* executor{};
+				BatchProcessFunction batch_function;
+				std::atomic<bool> scheduled{ false };
+				std::mutex mutex;
+				std::condition_variable done;
+			};
 
-			BufferProcessor(size_t _size, ProcessFunction _process_function) : RingBuffer<T>(_size)
+			void start_thread(BatchProcessFunction _batch_function)
 			{
 				this->release = [this]()
 				{
 					this->is_released = true;
-					this->cond_full.notify_one();
-					this->cond_empty.notify_one();
+					this->wake_all();
 					if (process_thread.joinable())
 						process_thread.join();
 				};
+				process_thread = std::thread([this, batch_function = std::move(_batch_function)]()
+				{
+					if (batch_function) this->invoke_batch_callback(batch_function);
+					else this->invoke_callback();
+				});
+			}
+			void start_drain(Executor* _executor, BatchProcessFunction _batch_function)
+			{
+				auto d = std::make_shared<Drain>();
+				d->executor = _executor;
+				d->batch_function = std::move(_batch_function);
+				this->release = [this, d]()
+				{
+					this->is_released = true;
+					this->wake_all();
+					wait_for_drain(*d);
+				};
+				this->set_on_head_advanced([this, d]()
+				{
+					schedule_drain(d);
+				});
+			}
+			void schedule_drain(const std::shared_ptr<Drain>& _d)
+			{
+				if (this->is_released) return;
+				if (_d->scheduled.exchange(true, std::memory_order_seq_cst)) return;
+				_d->executor->submit([this, _d]()
+				{ drain(_d); });
+			}
+			void drain(const std::shared_ptr<Drain>& _d)
+			{
+				size_t n = 0;
+				while (n < drain_budget && !this->is_released && !this->tail_advance_blocked())
+				{
+					if (_d->batch_function)
+					{
+						T* first = nullptr;
+						const size_t n_batch = this->acquire_tail_batch(first, drain_budget - n);
+						process_batch(_d->batch_function, first, n_batch);
+						this->release_tail_batch(n_batch);
+						n += n_batch;
+						continue;
+					}
+					process(this->advance_tail());
+					n++;
+				}
+				std::lock_guard<std::mutex> drain_lock(_d->mutex);
+				_d->scheduled.store(false, std::memory_order_seq_cst);
+				// Re-check so that a head advance which saw scheduled==true just before it was cleared isn't missed
+				if (!this->is_released && !this->tail_advance_blocked() && !_d->scheduled.exchange(true, std::memory_order_seq_cst))
+				{
+					_d->executor->submit([this, _d]()
+					{ drain(_d); });
+					return;
+				}
+				_d->done.notify_all();
+			}
+			static void wait_for_drain(Drain& _d)
+			{
+				std::unique_lock<std::mutex> drain_lock(_d.mutex);
+				_d.done.wait(drain_lock, [&_d]()
+				{ return !_d.scheduled.load(); });
+			}
+			void invoke_callback()
+			{
+				while (!this->is_released)
+				{
+					T* current = this->advance_tail();
+					if (this->is_released) break;
+
+					process(current);
+				}
+			}
+			void process(T* _x)
+			{
+				QueueStats* const stats = this->find_stats();
+				if (!stats)
+				{
+					process_function(_x);
+					return;
+				}
+				const uint64_t t_start = QueueStats::now_ns();
+				process_function(_x);
+				stats->on_processed(QueueStats::now_ns() - t_start);
+			}
+			void invoke_batch_callback(const BatchProcessFunction& _batch_function)
+			{
+				while (!this->is_released)
+				{
+					T* first = nullptr;
+					const size_t n = this->acquire_tail_batch(first);
+					if (this->is_released || !n) break;
+
+					process_batch(_batch_function, first, n);
+					this->release_tail_batch(n);
+				}
+			}
+			void process_batch(const BatchProcessFunction& _batch_function, T* _first, size_t _n)
+			{
+				QueueStats* const stats = this->find_stats();
+				if (!stats)
+				{
+					_batch_function(_first, _n);
+					return;
+				}
+				const uint64_t t_start = QueueStats::now_ns();
+				_batch_function(_first, _n);
+				stats->on_processed(QueueStats::now_ns() - t_start);
+			}
+	};
+
+	/*
+	 * Latest-value mailbox (triple buffer) for one producer and one consumer.
+	 *
+	 * The producer writes into write_slot() and publish()es it, which never blocks and replaces any
+	 * item the consumer hasn't taken yet. The consumer calls take(), which never blocks and returns the
+	 * newest published item (or nullptr if nothing new was published since the last take()). The item
+	 * returned by take() stays valid until the next call to take().
+	 *
+	 * Use this instead of RingBuffer where only the newest item matters (e.g. frames to a renderer).
+	 */
+	template<class T>
+	class Mailbox
+	{
+	 public:
+			static constexpr size_t num_slots = 3;
+
+			/*
+			 * Producer only
+			 */
+			T* write_slot()
+			{
+				return &slots[write_idx];
+			}
+			/*
+			 * Producer only. Hand the current write slot to the consumer and start writing to a free one.
+			 */
+			void publish()
+			{
+				const uint8_t prev = middle.exchange(static_cast<uint8_t>(write_idx | fresh_bit), std::memory_order_acq_rel);
+				write_idx = prev & idx_mask;
+				if (prev & fresh_bit) num_overwritten.fetch_add(1, std::memory_order_relaxed);
+				if (on_publish) on_publish();
+			}
+			/*
+			 * Consumer only
+			 */
+			T* take()
+			{
+				if (!has_new()) return nullptr;
+				const uint8_t prev = middle.exchange(read_idx, std::memory_order_acq_rel);
+				read_idx = prev & idx_mask;
+				return &slots[read_idx];
+			}
+			/*
+			 * Consumer only. The item returned by the last take(), or a slot which was never published.
+			 */
+			T* read_slot()
+			{
+				return &slots[read_idx];
+			}
+			bool has_new() const
+			{
+				return middle.load(std::memory_order_acquire) & fresh_bit;
+			}
+			/*
+			 * Number of published items which were replaced before the consumer took them
+			 */
+			size_t overwritten() const
+			{
+				return num_overwritten.load(std::memory_order_relaxed);
+			}
+			/*
+			 * Not thread safe, for initialising every slot before use
+			 */
+			T* slot(size_t _i)
+			{
+				return &slots[_i % num_slots];
+			}
+
+			/*
+			 * Called by the producer thread after every publish()
+			 */
+			std::function<void(void)> on_publish{};
+	 private:
+			static constexpr uint8_t idx_mask = 0x3;
+			static constexpr uint8_t fresh_bit = 0x4;
+			T slots[num_slots]{};
+			uint8_t write_idx = 0;
+			alignas(64) std::atomic<uint8_t> middle{ 1 };
+			alignas(64) uint8_t read_idx = 2;
+			std::atomic<size_t> num_overwritten{ 0 };
+	};
+
+	/*
+	 * A Mailbox with a consumer thread which is run for the newest item each time one is published.
+	 * Items published while the previous one is being processed are coalesced, only the last is processed.
+	 */
+	template<class T>
+	class MailboxProcessor : public Mailbox<T>
+	{
+	 public:
+			typedef std::function<void(T*)> ProcessFunction;
+			explicit MailboxProcessor(ProcessFunction _process_function)
+			{
 				process_function = _process_function;
+				this->on_publish = [this]()
+				{
+					parked.notify_one();
+				};
 				process_thread = std::thread([this]()
 				{
 					this->invoke_callback();
 				});
 			}
-			~BufferProcessor()
+			~MailboxProcessor()
 			{
-				this->is_released = true;
-				this->cond_full.notify_one();
-				this->cond_empty.notify_one();
+				release();
+			}
+			void release()
+			{
+				is_released = true;
+				parked.notify_all();
 				if (process_thread.joinable())
 					process_thread.join();
-//				delete[] buffer;
 			}
 	 private:
 			ProcessFunction process_function;
 			std::thread process_thread;
+			std::atomic<bool> is_released{ false };
+			EventCount parked;
+
 			void invoke_callback()
 			{
-				while (!this->is_released)
+				while (!is_released)
 				{
-					T* current = this->advance_tail();
-					if (this->is_released) break;
-
-					process_function(current);
+					T* current = this->take();
+					if (current)
+					{
+						process_function(current);
+						continue;
+					}
+					parked.await([this]()
+					{ return this->has_new() || is_released; });
 				}
 			}
 	};
 
 	/*
 	 * Non-busy execution blocking
+	 *
+	 * Like a condition variable, wait() only returns for a signal() which comes after it started waiting (or
+	 * spuriously). Callers waiting for some state should use wait(_ready), which also returns straight away if
+	 * the state is already there.
 	 */
 	class Waiter
 	{
@@ -235,8 +961,21 @@ namespace VIMR
 				std::unique_lock<std::mutex> cv_lock(cv_mut);
 				cv.wait(cv_lock);
 			}
+			/*
+			 * Block until _ready() returns true, _ready() is re-checked after every signal()
+			 */
+			template<class PRED_T>
+			void wait(PRED_T _ready)
+			{
+				std::unique_lock<std::mutex> cv_lock(cv_mut);
+				cv.wait(cv_lock, _ready);
+			}
 			void signal()
 			{
+				// So that a wait(_ready) which has just seen _ready() == false is already waiting when notified
+				{
+					std::lock_guard<std::mutex> cv_lock(cv_mut);
+				}
 				cv.notify_all();
 			}
 	 private:
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "async.hpp"
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+namespace VIMR {
+  /*
+   * Micro-benchmark for the RingBuffer variants, e.g.
+   *
+   *   auto mtx = bench_ringbuffer<RingBuffer<uint64_t>>(1000000, 128);
+   *   auto spsc = bench_ringbuffer<SPSCRingBuffer<uint64_t>>(1000000, 128);
+   *
+   * Throughput is measured with the producer pushing as fast as it can, latency is measured with the
+   * producer pushing one item every _latency_gap_us so that the consumer has to wake up for each item.
+   */
+  struct RingBenchResult {
+    double items_per_sec{};
+    double latency_p50_us{};
+    double latency_p99_us{};
+    double latency_max_us{};
+  };
+
+  template<class RING_T>
+  RingBenchResult bench_ringbuffer(size_t _n_items, size_t _q_size, size_t _n_latency_items = 20000, unsigned _latency_gap_us = 50) {
+    using clk = std::chrono::steady_clock;
+    const auto now_ns = []() {
+      return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(clk::now().time_since_epoch()).count());
+    };
+    RingBenchResult res{};
+
+    {
+      RING_T rb(_q_size);
+      uint64_t sum = 0;
+      const auto t_start = clk::now();
+      std::thread consumer([&]() {
+        for (size_t i = 0; i < _n_items; i++) sum += *rb.advance_tail();
+      });
+      for (size_t i = 0; i < _n_items; i++) {
+        *rb.current_head() = i;
+        rb.advance_head();
+      }
+      consumer.join();
+      const double secs = std::chrono::duration<double>(clk::now() - t_start).count();
+      res.items_per_sec = (sum == (_n_items * (_n_items - 1)) / 2) ? _n_items / secs : 0;
+      rb.release();
+    }
+
+    {
+      RING_T rb(_q_size);
+      std::vector<double> lat_us(_n_latency_items);
+      std::thread consumer([&]() {
+        for (size_t i = 0; i < _n_latency_items; i++) {
+          const uint64_t t_sent = *rb.advance_tail();
+          lat_us[i] = (now_ns() - t_sent) * 1e-3;
+        }
+      });
+      for (size_t i = 0; i < _n_latency_items; i++) {
+        const auto t_next = clk::now() + std::chrono::microseconds(_latency_gap_us);
+        *rb.current_head() = now_ns();
+        rb.advance_head();
+        while (clk::now() < t_next) std::this_thread::yield();
+      }
+      consumer.join();
+      rb.release();
+      std::sort(lat_us.begin(), lat_us.end());
+      if (!lat_us.empty()) {
+        res.latency_p50_us = lat_us[lat_us.size() / 2];
+        res.latency_p99_us = lat_us[(lat_us.size() * 99) / 100];
+        res.latency_max_us = lat_us.back();
+      }
+    }
+    return res;
+  }
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace VIMR {
+  /*
+   * Append-only bit packer, bits are written LSB-first into a growable byte vector.
+   *
+   * Call flush() before using bytes(), the partially filled tail byte is not copied until then.
+   */
+  class BitWriter {
+    std::vector<uint8_t> data{};
+    uint64_t acc = 0;
+    unsigned acc_bits = 0;
+   public:
+    void reset() {
+      data.clear();
+      acc = 0;
+      acc_bits = 0;
+    }
+    void reserve(size_t _n_bytes) {
+      data.reserve(_n_bytes);
+    }
+    /*
+     * _n <= 32
+     */
+    void put(uint32_t _v, unsigned _n) {
+      acc |= static_cast<uint64_t>(_v & ((_n < 32) ? ((1u << _n) - 1) : 0xFFFFFFFFu)) << acc_bits;
+      acc_bits += _n;
+      while (acc_bits >= 8) {
+        data.push_back(static_cast<uint8_t>(acc));
+        acc >>= 8;
+        acc_bits -= 8;
+      }
+    }
+    void put_bit(bool _b) {
+      put(_b ? 1u : 0u, 1);
+    }
+    /*
+     * Adaptive Golomb-Rice code for a non-negative value. Quotients longer than
+     * _max_unary are escaped and written as a raw 32-bit value.
+     */
+    void put_rice(uint32_t _v, unsigned _k, unsigned _max_unary = 24) {
+      const uint32_t q = _v >> _k;
+      if (q >= _max_unary) {
+        for (unsigned i = 0; i < _max_unary; i++) put_bit(true);
+        put(_v, 32);
+        return;
+      }
+      for (uint32_t i = 0; i < q; i++) put_bit(true);
+      put_bit(false);
+      if (_k) put(_v, _k);
+    }
+    void flush() {
+      if (acc_bits) {
+        data.push_back(static_cast<uint8_t>(acc));
+        acc = 0;
+        acc_bits = 0;
+      }
+    }
+    const uint8_t* bytes() const {
+      return data.data();
+    }
+    size_t size() const {
+      return data.size();
+    }
+  };
+
+  /*
+   * Reads a stream written by BitWriter. Reading past the end returns zero bits and sets overrun().
+   */
+  class BitReader {
+    const uint8_t* data{};
+    size_t n_bytes{};
+    size_t byte_idx = 0;
+    uint64_t acc = 0;
+    unsigned acc_bits = 0;
+    bool overran = false;
+    void refill() {
+      while (acc_bits <= 56) {
+        if (byte_idx < n_bytes) acc |= static_cast<uint64_t>(data[byte_idx]) << acc_bits;
+        else if (byte_idx >= n_bytes + 8) {
+          overran = true;
+          return;
+        }
+        byte_idx++;
+        acc_bits += 8;
+      }
+    }
+   public:
+    BitReader(const uint8_t* _data, size_t _n_bytes) : data(_data), n_bytes(_n_bytes) {}
+    uint32_t get(unsigned _n) {
+      if (acc_bits < _n) refill();
+      if (acc_bits < _n) return 0;
+      const uint32_t v = static_cast<uint32_t>(acc & ((_n < 32) ? ((1ull << _n) - 1) : 0xFFFFFFFFull));
+      acc >>= _n;
+      acc_bits -= _n;
+      return v;
+    }
+    bool get_bit() {
+      return get(1) != 0;
+    }
+    uint32_t get_rice(unsigned _k, unsigned _max_unary = 24) {
+      uint32_t q = 0;
+      while (q < _max_unary && get_bit()) q++;
+      if (q >= _max_unary) return get(32);
+      return (q << _k) | (_k ? get(_k) : 0);
+    }
+    /*
+     * True if more bits were read than were written
+     */
+    bool overrun() const {
+      return overran || (byte_idx * 8 - acc_bits) > n_bytes * 8;
+    }
+  };
+
+  /*
+   * Tracks the running mean magnitude of a residual stream and picks the Rice parameter for it (as in LOCO-I)
+   */
+  struct RiceContext {
+    uint32_t sum = 4;
+    uint32_t count = 1;
+    unsigned k() const {
+      unsigned k = 0;
+      while ((count << k) < sum && k < 24) k++;
+      return k;
+    }
+    void update(uint32_t _v) {
+      sum += _v;
+      if (++count >= 64) {
+        sum >>= 1;
+        count >>= 1;
+      }
+    }
+  };
+
+  inline uint32_t zigzag(int32_t _v) {
+    return (static_cast<uint32_t>(_v) << 1) ^ static_cast<uint32_t>(_v >> 31);
+  }
+  inline int32_t unzigzag(uint32_t _v) {
+    return static_cast<int32_t>(_v >> 1) ^ -static_cast<int32_t>(_v & 1);
+  }
+}
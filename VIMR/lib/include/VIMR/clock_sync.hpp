@@ -0,0 +1,203 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+#include "freq_estimation.hpp"
+
+namespace VIMR {
+  namespace Network {
+    /*
+     * NTP style estimate of a peer's steady clock relative to ours, from probe round trips:
+     *   t1 = probe sent (our clock), t2 = probe received, t3 = reply sent (peer's clock), t4 = reply received (ours)
+     *   offset = ((t2 - t1) + (t3 - t4)) / 2, rtt = (t4 - t1) - (t3 - t2)
+     * A sample's offset is wrong by at most rtt / 2 (all of the queueing delay on one way), so only the samples
+     * with the lowest round trip in the window are used. Once they span long enough, a line is fitted through them
+     * to follow the drift between the two crystals.
+     *
+     * add_sample() and the getters may be called from different threads.
+     */
+    class ClockSync {
+     public:
+      // Samples kept, at one probe per second about a minute
+      static constexpr size_t window = 64;
+      // Samples before synced()
+      static constexpr size_t min_samples = 4;
+      // Samples with a round trip up to min_rtt * rtt_tolerance + rtt_slack_us count as good
+      static constexpr double rtt_tolerance = 1.5;
+      static constexpr double rtt_slack_us = 200;
+      // Good samples have to span this long before drift is estimated
+      static constexpr double min_drift_span_us = 10e6;
+      // More than this is a bad fit, not a real crystal
+      static constexpr double max_drift = 500e-6;
+
+      void add_sample(int64_t _t1, int64_t _t2, int64_t _t3, int64_t _t4) {
+        const double rtt = static_cast<double>(_t4 - _t1) - static_cast<double>(_t3 - _t2);
+        // The peer can't have taken longer than the whole round trip
+        if (_t4 < _t1 || rtt < 0) return;
+        const double offset = 0.5 * (static_cast<double>(_t2 - _t1) + static_cast<double>(_t3 - _t4));
+        std::lock_guard<std::mutex> lock(mutex);
+        samples.push_back({ static_cast<double>(_t1 + (_t4 - _t1) / 2), offset, rtt });
+        if (samples.size() > window) samples.pop_front();
+        fit();
+      }
+      bool synced() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return samples.size() >= min_samples;
+      }
+      /*
+       * Peer clock minus ours at our time _local_us
+       */
+      double offset_us(int64_t _local_us) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return offset_at(static_cast<double>(_local_us));
+      }
+      /*
+       * A time on the peer's steady clock in ours
+       */
+      int64_t to_local_us(int64_t _peer_us) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        // The offset changes by less than a microsecond between the two clocks' readings of the same instant
+        return _peer_us - static_cast<int64_t>(offset_at(static_cast<double>(_peer_us) - offset_at(static_cast<double>(_peer_us))));
+      }
+      int64_t to_peer_us(int64_t _local_us) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return _local_us + static_cast<int64_t>(offset_at(static_cast<double>(_local_us)));
+      }
+      /*
+       * How far off offset_us() can be: half the best round trip
+       */
+      double error_bound_us() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return 0.5 * min_rtt;
+      }
+      double min_rtt_us() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return min_rtt;
+      }
+      double drift_ppm() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return drift * 1e6;
+      }
+      size_t num_samples() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return samples.size();
+      }
+      void reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        samples.clear();
+        min_rtt = 0;
+        t_ref = 0;
+        offset_ref = 0;
+        drift = 0;
+      }
+
+     private:
+      struct Sample {
+        double local_us;
+        double offset_us;
+        double rtt_us;
+      };
+      mutable std::mutex mutex;
+      std::deque<Sample> samples;
+      std::vector<const Sample*> good;
+      double min_rtt = 0;
+      // offset(t) = offset_ref + drift * (t - t_ref)
+      double t_ref = 0;
+      double offset_ref = 0;
+      double drift = 0;
+
+      double offset_at(double _local_us) const {
+        return offset_ref + drift * (_local_us - t_ref);
+      }
+      void fit() {
+        const Sample* best = &samples.front();
+        for (const auto& s: samples) if (s.rtt_us < best->rtt_us) best = &s;
+        min_rtt = best->rtt_us;
+        good.clear();
+        for (const auto& s: samples) if (s.rtt_us <= min_rtt * rtt_tolerance + rtt_slack_us) good.push_back(&s);
+
+        t_ref = best->local_us;
+        offset_ref = best->offset_us;
+        drift = 0;
+        if (good.size() < min_samples || good.back()->local_us - good.front()->local_us < min_drift_span_us) return;
+        // Least squares line through the good samples
+        double mean_t = 0, mean_o = 0;
+        for (const auto* s: good) {
+          mean_t += s->local_us;
+          mean_o += s->offset_us;
+        }
+        mean_t /= good.size();
+        mean_o /= good.size();
+        double stt = 0, sto = 0;
+        for (const auto* s: good) {
+          stt += (s->local_us - mean_t) * (s->local_us - mean_t);
+          sto += (s->local_us - mean_t) * (s->offset_us - mean_o);
+        }
+        const double slope = stt > 0 ? sto / stt : 0;
+        if (slope > max_drift || slope < -max_drift) return;
+        t_ref = mean_t;
+        offset_ref = mean_o;
+        drift = slope;
+      }
+    };
+
+    /*
+     * Rolling statistics of the last window latencies, e.g. capture to display of voxel frames.
+     * add() and the getters may be called from different threads.
+     */
+    class LatencyStats {
+     public:
+      static constexpr size_t window = 512;
+
+      void add(double _ms) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (values.size() < window) values.push_back(_ms);
+        else values[n_added % window] = _ms;
+        n_added++;
+      }
+      size_t count() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return n_added;
+      }
+      /*
+       * _p in [0, 1] of the window, 0 if nothing was added yet
+       */
+      double percentile(double _p) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (values.empty()) return 0;
+        sorted = values;
+        const size_t i = static_cast<size_t>(std::clamp(_p, 0.0, 1.0) * (sorted.size() - 1));
+        std::nth_element(sorted.begin(), sorted.begin() + i, sorted.end());
+        return sorted[i];
+      }
+      double mean() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        double sum = 0;
+        for (const auto v: values) sum += v;
+        return values.empty() ? 0 : sum / values.size();
+      }
+      std::string summary() const {
+        char s[160];
+        snprintf(s, sizeof(s), "%zu frames, mean %.2fms p50 %.2fms p95 %.2fms p99 %.2fms max %.2fms",
+                 count(), mean(), percentile(0.5), percentile(0.95), percentile(0.99), percentile(1));
+        return s;
+      }
+      void reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        values.clear();
+        n_added = 0;
+      }
+
+     private:
+      mutable std::mutex mutex;
+      std::vector<double> values;
+      mutable std::vector<double> sorted;
+      size_t n_added = 0;
+    };
+  }
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "colour_predictive.hpp"
+#include "label_compression.hpp"
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+namespace VIMR {
+  /*
+   * Round-trip check and micro-benchmark for the voxel attribute codecs, e.g.
+   *
+   *   auto lossless = bench_colour_codec(200000, 0, 0, false);
+   *   auto lossy = bench_colour_codec(200000);
+   *   auto labels = bench_label_codec(6, 24);
+   *
+   * The input is a synthetic Morton-ordered stream: smooth colour gradients with noise, grouped into
+   * parent nodes of 1-8 leaves. ok is false if decoding fails, or if lossless settings do not reproduce
+   * the input exactly. max_error is the largest per-channel difference after the round trip.
+   *
+   * The label benchmark builds a sparse octree whose leaves carry labels in contiguous Morton runs (like body
+   * part IDs), with a fraction of isolated noisy leaves. Label coding is lossless, so ok requires an exact match;
+   * max_error is the number of leaves whose label differs after the round trip.
+   */
+  struct CodecBenchResult {
+    bool ok{};
+    double bytes_per_item{};
+    double encode_items_per_sec{};
+    double decode_items_per_sec{};
+    int max_error{};
+  };
+
+  inline CodecBenchResult bench_colour_codec(size_t _n_voxels, uint8_t _luma_shift = 1, uint8_t _chroma_shift = 2,
+                                             bool _chroma_subsample = true, int _n_reps = 10, unsigned _seed = 1) {
+    using clk = std::chrono::steady_clock;
+    CodecBenchResult res{};
+    std::mt19937 rng(_seed);
+    std::uniform_int_distribution<int> noise(-6, 6), group_len(1, 8);
+    std::vector<unsigned char> bgr(3 * _n_voxels), bgr_out(3 * _n_voxels);
+    std::vector<uint8_t> group_start(_n_voxels);
+    for (size_t i = 0, next_group = 0; i < _n_voxels; i++) {
+      group_start[i] = (i == next_group);
+      if (group_start[i]) next_group += group_len(rng);
+      for (size_t c = 0; c < 3; c++) {
+        const int base = static_cast<int>((i * (c + 1) / 64) % 256);
+        bgr[3 * i + c] = static_cast<unsigned char>(std::clamp(base + noise(rng), 0, 255));
+      }
+    }
+
+    PredictiveColour codec;
+    codec.luma_shift = _luma_shift;
+    codec.chroma_shift = _chroma_shift;
+    codec.chroma_subsample = _chroma_subsample;
+    SerialBuffer<1 << 20, 1 << 28, 1 << 20> buf;
+
+    const auto t_enc = clk::now();
+    for (int r = 0; r < _n_reps; r++) {
+      buf.reset();
+      if (!codec.encode(bgr.data(), group_start.data(), _n_voxels, &buf)) return res;
+    }
+    res.encode_items_per_sec = _n_reps * _n_voxels / std::chrono::duration<double>(clk::now() - t_enc).count();
+
+    const auto t_dec = clk::now();
+    for (int r = 0; r < _n_reps; r++) {
+      buf.seekstart();
+      if (!codec.decode(&buf, group_start.data(), _n_voxels, bgr_out.data())) return res;
+    }
+    res.decode_items_per_sec = _n_reps * _n_voxels / std::chrono::duration<double>(clk::now() - t_dec).count();
+    res.bytes_per_item = _n_voxels ? static_cast<double>(buf.size()) / _n_voxels : 0;
+
+    for (size_t i = 0; i < bgr.size(); i++) res.max_error = std::max(res.max_error, std::abs(bgr[i] - bgr_out[i]));
+    const bool lossless = !_luma_shift && !_chroma_shift && !_chroma_subsample;
+    res.ok = !lossless || res.max_error == 0;
+    return res;
+  }
+
+  inline CodecBenchResult bench_label_codec(int _depth, uint8_t _label_bits, double _noise = 0.02, int _n_reps = 10, unsigned _seed = 1) {
+    using clk = std::chrono::steady_clock;
+    CodecBenchResult res{};
+    std::mt19937 rng(_seed);
+    std::uniform_real_distribution<double> u(0, 1);
+    const uint32_t label_mask = _label_bits >= 32 ? 0xFFFFFFFFu : ((1u << _label_bits) - 1);
+
+    // Voxel has no destructor that frees its data, so the nodes are kept here and freed at the end
+    std::deque<Voxel> nodes;
+    nodes.emplace_back();
+    std::vector<Voxel*> level{&nodes.back()};
+    for (int d = 0; d < _depth; d++) {
+      std::vector<Voxel*> next;
+      for (auto* p: level) {
+        for (int c = 0; c < 8; c++) {
+          if (c != 0 && u(rng) > 0.6) continue;
+          nodes.emplace_back();
+          Voxel* v = &nodes.back();
+          v->parent = p;
+          p->children[c] = v;
+          next.push_back(v);
+        }
+      }
+      level.swap(next);
+    }
+    const std::vector<Voxel*>& leaves = level;
+    std::vector<uint32_t> labels(leaves.size()), labels_out(leaves.size());
+    uint32_t run_label = 0;
+    for (size_t i = 0; i < leaves.size(); i++) {
+      leaves[i]->morton = i;
+      if (u(rng) < 1.0 / 2000) run_label = static_cast<uint32_t>(rng()) & label_mask;
+      labels[i] = (u(rng) < _noise) ? (static_cast<uint32_t>(rng()) & label_mask) : run_label;
+    }
+
+    HierarchicalLabels codec;
+    SerialBuffer<1 << 20, 1 << 28, 1 << 20> buf;
+    const auto get_label = [&labels](Voxel* _v) { return labels[_v->morton]; };
+    const auto set_label = [&labels_out](Voxel* _v, uint32_t _l) { labels_out[_v->morton] = _l; };
+
+    const auto t_enc = clk::now();
+    bool enc_ok = true;
+    for (int r = 0; r < _n_reps && enc_ok; r++) {
+      buf.reset();
+      enc_ok = codec.encode(&nodes.front(), _label_bits, get_label, &buf);
+    }
+    res.encode_items_per_sec = _n_reps * leaves.size() / std::chrono::duration<double>(clk::now() - t_enc).count();
+
+    const auto t_dec = clk::now();
+    bool dec_ok = enc_ok;
+    for (int r = 0; r < _n_reps && dec_ok; r++) {
+      buf.seekstart();
+      dec_ok = codec.decode(&buf, &nodes.front(), set_label);
+    }
+    res.decode_items_per_sec = _n_reps * leaves.size() / std::chrono::duration<double>(clk::now() - t_dec).count();
+    res.bytes_per_item = leaves.empty() ? 0 : static_cast<double>(buf.size()) / leaves.size();
+
+    for (size_t i = 0; i < labels.size(); i++) if (labels[i] != labels_out[i]) res.max_error++;
+    res.ok = dec_ok && res.max_error == 0;
+    for (auto& v: nodes) delete[] v.data;
+    return res;
+  }
+}
@@ -0,0 +1,218 @@
+#pragma once
+
+#include "octree.hpp"
+#include "voxencoding.hpp"
+#include "serialbuffer.hpp"
+#include "bitstream.hpp"
+#include <algorithm>
+#include <vector>
+
+namespace VIMR {
+  /*
+   * Predictive colour coding for a Morton-ordered voxel stream.
+   *
+   * Colours are converted to YCoCg-R, optionally quantized, predicted from the previous voxel in
+   * Morton order and the residuals are Golomb-Rice coded with an adaptive parameter per channel.
+   * With chroma subsampling enabled, Co/Cg are stored once per parent node (the mean of its leaves)
+   * and predicted from the previous parent.
+   *
+   * With luma_shift == chroma_shift == 0 and no subsampling the coding is lossless.
+   *
+   * Serial layout (after the colour bytes of the octree, or wherever the caller puts it):
+   *   uint32 voxel count, uint8 flags, uint8 luma shift, uint8 chroma shift, uint32 n bytes, bit stream
+   */
+  class PredictiveColour {
+   public:
+    bool chroma_subsample = true;
+    uint8_t luma_shift = 1;
+    uint8_t chroma_shift = 2;
+
+    static void bgr_to_ycocg(const unsigned char* _bgr, int& _y, int& _co, int& _cg) {
+      const int b = _bgr[0], g = _bgr[1], r = _bgr[2];
+      _co = r - b;
+      const int t = b + (_co >> 1);
+      _cg = g - t;
+      _y = t + (_cg >> 1);
+    }
+    static void ycocg_to_bgr(int _y, int _co, int _cg, unsigned char* _bgr) {
+      const int t = _y - (_cg >> 1);
+      const int g = _cg + t;
+      const int b = t - (_co >> 1);
+      const int r = b + _co;
+      _bgr[0] = static_cast<unsigned char>(std::clamp(b, 0, 255));
+      _bgr[1] = static_cast<unsigned char>(std::clamp(g, 0, 255));
+      _bgr[2] = static_cast<unsigned char>(std::clamp(r, 0, 255));
+    }
+
+    /*
+     * Encode _n BGR triples. _group_start[i] != 0 marks the first voxel of a new parent node, and may be
+     * nullptr if chroma_subsample is false.
+     */
+    bool encode(const unsigned char* _bgr, const uint8_t* _group_start, size_t _n, BufWriter* _dst) {
+      const bool subsample = chroma_subsample && _group_start;
+      bits.reset();
+      bits.reserve(_n);
+      RiceContext ctx_y, ctx_co, ctx_cg;
+      int prev_y = 0, prev_co = 0, prev_cg = 0;
+      size_t i = 0;
+      while (i < _n) {
+        size_t group_end = i + 1;
+        if (subsample) {
+          while (group_end < _n && !_group_start[group_end]) group_end++;
+          int sum_co = 0, sum_cg = 0;
+          for (size_t j = i; j < group_end; j++) {
+            int y, co, cg;
+            bgr_to_ycocg(&_bgr[3 * j], y, co, cg);
+            sum_co += co;
+            sum_cg += cg;
+          }
+          const int cnt = static_cast<int>(group_end - i);
+          put_residual(quant(div_round(sum_co, cnt), chroma_shift), prev_co, ctx_co);
+          put_residual(quant(div_round(sum_cg, cnt), chroma_shift), prev_cg, ctx_cg);
+          for (size_t j = i; j < group_end; j++) {
+            int y, co, cg;
+            bgr_to_ycocg(&_bgr[3 * j], y, co, cg);
+            put_residual(quant(y, luma_shift), prev_y, ctx_y);
+          }
+        }
+        else {
+          int y, co, cg;
+          bgr_to_ycocg(&_bgr[3 * i], y, co, cg);
+          put_residual(quant(y, luma_shift), prev_y, ctx_y);
+          put_residual(quant(co, chroma_shift), prev_co, ctx_co);
+          put_residual(quant(cg, chroma_shift), prev_cg, ctx_cg);
+        }
+        i = group_end;
+      }
+      bits.flush();
+
+      const auto n_vox = static_cast<uint32_t>(_n);
+      const uint8_t flags = subsample ? 1 : 0;
+      const auto n_bytes = static_cast<uint32_t>(bits.size());
+      if (!_dst->put(n_vox)) return false;
+      if (!_dst->put(flags)) return false;
+      if (!_dst->put(luma_shift)) return false;
+      if (!_dst->put(chroma_shift)) return false;
+      if (!_dst->put(n_bytes)) return false;
+      return _dst->put(reinterpret_cast<const char*>(bits.bytes()), n_bytes);
+    }
+
+    /*
+     * Decode into _bgr_out, which must have space for 3 * (voxel count) bytes. _group_start must match what
+     * was passed to encode() if the stream is chroma-subsampled.
+     */
+    bool decode(BufReader* _src, const uint8_t* _group_start, size_t _n, unsigned char* _bgr_out) {
+      uint32_t n_vox, n_bytes;
+      uint8_t flags, l_shift, c_shift;
+      if (!_src->pop(n_vox)) return false;
+      if (!_src->pop(flags)) return false;
+      if (!_src->pop(l_shift)) return false;
+      if (!_src->pop(c_shift)) return false;
+      if (!_src->pop(n_bytes)) return false;
+      if (n_vox != _n || _src->read_headroom() < n_bytes) return false;
+      const bool subsample = flags & 1;
+      if (subsample && !_group_start) return false;
+
+      BitReader in(reinterpret_cast<const uint8_t*>(_src->read_ptr()), n_bytes);
+      RiceContext ctx_y, ctx_co, ctx_cg;
+      int prev_y = 0, prev_co = 0, prev_cg = 0;
+      size_t i = 0;
+      while (i < _n) {
+        size_t group_end = i + 1;
+        if (subsample) {
+          while (group_end < _n && !_group_start[group_end]) group_end++;
+          const int co = unquant(get_residual(in, prev_co, ctx_co), c_shift);
+          const int cg = unquant(get_residual(in, prev_cg, ctx_cg), c_shift);
+          for (size_t j = i; j < group_end; j++) {
+            const int y = unquant(get_residual(in, prev_y, ctx_y), l_shift);
+            ycocg_to_bgr(y, co, cg, &_bgr_out[3 * j]);
+          }
+        }
+        else {
+          const int y = unquant(get_residual(in, prev_y, ctx_y), l_shift);
+          const int co = unquant(get_residual(in, prev_co, ctx_co), c_shift);
+          const int cg = unquant(get_residual(in, prev_cg, ctx_cg), c_shift);
+          ycocg_to_bgr(y, co, cg, &_bgr_out[3 * i]);
+        }
+        i = group_end;
+      }
+      if (in.overrun()) return false;
+      tmp_skip.resize(n_bytes);
+      return _src->pop(tmp_skip.data(), n_bytes);
+    }
+
+    /*
+     * Encode the colours of every voxel in _o, in the order given by Octree::begin()/end() (i.e. Morton order
+     * after unpack() or finalize()).
+     */
+    bool encode(Octree& _o, const VoxelEncoding& _e, BufWriter* _dst) {
+      gather(_o);
+      int src;
+      size_t i = 0;
+      for (auto** v = _o.begin(); v != _o.end(); v++, i++) _e.decode(*v, &tmp_bgr[3 * i], src);
+      return encode(tmp_bgr.data(), tmp_group.data(), tmp_group.size(), _dst);
+    }
+
+    /*
+     * Overwrite the colours of every voxel in _o. _o must have the same structure and order as when encoded.
+     * Source, labels and flags of each voxel are left as they were.
+     */
+    bool decode(BufReader* _src, Octree& _o, const VoxelEncoding& _e) {
+      gather(_o);
+      if (!decode(_src, tmp_group.data(), tmp_group.size(), tmp_bgr.data())) return false;
+      const bool has_labels = _e.get_num_label_bytes() > 0;
+      const bool has_meta = _e.get_metadata_enabled();
+      static constexpr VoxelEncoding::Flag all_flags[] = {VoxelEncoding::SPECIAL, VoxelEncoding::INVISIBLE, VoxelEncoding::F2, VoxelEncoding::F3};
+      int src;
+      unsigned char unused[3];
+      unsigned char labels[Voxel::MAX_BYTES];
+      size_t i = 0;
+      for (auto** v = _o.begin(); v != _o.end(); v++, i++) {
+        _e.decode(*v, unused, src, has_labels ? labels : nullptr);
+        int flags = 0;
+        if (has_meta) for (const auto f: all_flags) if (_e.get_flag(*v, f)) flags |= f;
+        _e.encode(*v, &tmp_bgr[3 * i], src, has_labels ? labels : nullptr);
+        if (has_meta) for (const auto f: all_flags) (flags & f) ? _e.set_flag(*v, f) : _e.clear_flag(*v, f);
+      }
+      return true;
+    }
+
+   private:
+    BitWriter bits{};
+    std::vector<unsigned char> tmp_bgr{};
+    std::vector<uint8_t> tmp_group{};
+    std::vector<char> tmp_skip{};
+
+    void gather(Octree& _o) {
+      tmp_group.clear();
+      const Voxel* last_parent = nullptr;
+      for (auto** v = _o.begin(); v != _o.end(); v++) {
+        tmp_group.push_back((*v)->parent != last_parent);
+        last_parent = (*v)->parent;
+      }
+      tmp_bgr.resize(3 * tmp_group.size());
+    }
+    static int div_round(int _a, int _b) {
+      return (_a >= 0) ? (_a + _b / 2) / _b : -((-_a + _b / 2) / _b);
+    }
+    static int quant(int _v, uint8_t _shift) {
+      if (!_shift) return _v;
+      return div_round(_v, 1 << _shift);
+    }
+    static int unquant(int _v, uint8_t _shift) {
+      return _v * (1 << _shift);
+    }
+    void put_residual(int _v, int& _prev, RiceContext& _ctx) {
+      const uint32_t r = zigzag(_v - _prev);
+      bits.put_rice(r, _ctx.k());
+      _ctx.update(r);
+      _prev = _v;
+    }
+    static int get_residual(BitReader& _in, int& _prev, RiceContext& _ctx) {
+      const uint32_t r = _in.get_rice(_ctx.k());
+      _ctx.update(r);
+      _prev += unzigzag(r);
+      return _prev;
+    }
+  };
+}
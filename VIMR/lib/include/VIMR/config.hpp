@@ -3,15 +3,78 @@
 #include <string>
 #include "async_log.hpp"
 #include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
 #include <sstream>
 #include <iostream>
 #include "vimr_api.hpp"
+#include "side_table.hpp"
 
 using std::string;
 
 #define CFG_FILENAME "component.json"
 
 namespace VIMR {
+  /*
+   * The value at _scoped_key in _j, or nullptr. Same lookup as ConfigFile::traverse(): the key is split at ':' and each
+   * part selects a member of the object before it. Keys which aren't found that way are looked up whole at the top.
+   * Walks _j in place, nothing is copied.
+   */
+  inline const nlohmann::json* find_scoped(const nlohmann::json& _j, const std::string& _scoped_key) {
+    const nlohmann::json* node = &_j;
+    size_t start = 0;
+    while (start < _scoped_key.size()) {
+      size_t end = _scoped_key.find(':', start);
+      if (end == std::string::npos) end = _scoped_key.size();
+      if (end > start) {
+        if (!node->is_object()) {
+          node = nullptr;
+          break;
+        }
+        const auto it = node->find(_scoped_key.substr(start, end - start));
+        if (it == node->end()) {
+          node = nullptr;
+          break;
+        }
+        node = &*it;
+      }
+      start = end + 1;
+    }
+    if (node) return node;
+    const auto it = _j.find(_scoped_key);
+    return it == _j.end() ? nullptr : &*it;
+  }
+
+  /*
+   * An immutable copy of a ConfigFile's json, see ConfigFile::snapshot()
+   */
+  struct ConfigSnapshot {
+    nlohmann::json j;
+    unsigned long long generation{};
+    // Whether the ConfigFile had been loaded when this was taken
+    bool loaded{};
+
+    const nlohmann::json* find(const std::string& _scoped_key) const {
+      return find_scoped(j, _scoped_key);
+    }
+  };
+  /*
+   * A ConfigFile's generation and current snapshot. ConfigFile is embedded in classes which vimr.dll constructs, so
+   * this lives in a SideTable rather than in ConfigFile.
+   */
+  struct ConfigPublished {
+    std::mutex mutex;
+    std::shared_ptr<const ConfigSnapshot> snap;
+    std::atomic<unsigned long long> generation{ next_generation() };
+
+    // Unique across all ConfigFiles, so that a generation from before an entry was replaced never matches
+    static unsigned long long next_generation() {
+      static std::atomic<unsigned long long> n{ 0 };
+      return ++n;
+    }
+  };
+
   class VIMR_INTERFACE ConfigFile {
    private:
     bool loaded = false;
@@ -57,21 +120,15 @@ namespace VIMR {
      */
     template<class T>
     T get(const std::string& _scoped_key, const T& _default, LogLvl _l) {
-      nlohmann::json jtmp = j;
+      const nlohmann::json* node = find(_scoped_key);
       T val;
-      if (traverse(_scoped_key, jtmp)) {
-        try { val = jtmp.get<T>(); }
-        catch (const std::exception&) {
-          log(LogLvl::Warn, "Config", "%s=%s (default)", _scoped_key.c_str(), stringify(_default).c_str());
-          return _default;
-        }
+      try {
+        if (!node) throw std::exception();
+        val = node->get<T>();
       }
-      else {
-        try { val = jtmp.at(_scoped_key).get<T>(); }
-        catch (const std::exception&) {
-          log(LogLvl::Warn, "Config", "%s=%s (default)", _scoped_key.c_str(), stringify(_default).c_str());
-          return _default;
-        }
+      catch (const std::exception&) {
+        log(LogLvl::Warn, "Config", "%s=%s (default)", _scoped_key.c_str(), stringify(_default).c_str());
+        return _default;
       }
       log(_l, "Config", "%s=%s", _scoped_key.c_str(), stringify(val).c_str());
       return val;
@@ -82,36 +139,75 @@ namespace VIMR {
      */
     template<class T>
     T get(const std::string& _scoped_key, LogLvl _l) {
-      nlohmann::json jtmp = j;
-      T val;
-      if (traverse(_scoped_key, jtmp)) {
-        try { val = jtmp.get<T>(); }
-        catch (const std::exception& _e) {
-          log(LogLvl::Fatal, "Config", "getting non-optional key '%s' failed: %s", _scoped_key.c_str(), _e.what());
-          throw std::exception();
-        }
+      const nlohmann::json* node = find(_scoped_key);
+      if (!node) {
+        log(LogLvl::Fatal, "Config", "getting non-optional key '%s' failed: not found", _scoped_key.c_str());
+        throw std::exception();
       }
-      else {
-        try { val = jtmp.at(_scoped_key).get<T>(); }
-        catch (const std::exception& _e) {
-          log(LogLvl::Fatal, "Config", "getting non-optional key '%s' failed: %s", _scoped_key.c_str(), _e.what());
-          throw std::exception();
-        }
+      T val;
+      try { val = node->get<T>(); }
+      catch (const std::exception& _e) {
+        log(LogLvl::Fatal, "Config", "getting non-optional key '%s' failed: %s", _scoped_key.c_str(), _e.what());
+        throw std::exception();
       }
       log(_l, "Config", "%s=%s", _scoped_key.c_str(), stringify(val).c_str());
-      return std::move(val);
+      return val;
     }
 
    public:
+    ~ConfigFile() {
+      SideTable<ConfigPublished>::erase(this, root());
+    }
     bool load(const std::string& _file_path, const std::string& _cmp_id);
 		bool load(const std::string& _file_path);
     bool load();
 
     bool is_loaded() const;
 
-    bool has(const std::string& _scoped_key) {
-      nlohmann::json jtmp = j;
-      return traverse(_scoped_key, jtmp);
+    bool has(const std::string& _scoped_key) const {
+      return find(_scoped_key) != nullptr;
+    }
+    /*
+     * The value at _scoped_key (see find_scoped()), or nullptr. Points into the live json, so it's only valid until
+     * the config is loaded again or inserted into.
+     */
+    const nlohmann::json* find(const std::string& _scoped_key) const {
+      return find_scoped(j, _scoped_key);
+    }
+    /*
+     * Changes whenever the json may have: on insert() and publish(), and when load() replaces the json (which the
+     * library does without going through these headers, so that is noticed by the json's storage moving). An edit
+     * in place that bypasses these is only seen after publish(). One SideTable lookup, cheap enough for every read.
+     */
+    unsigned long long generation() {
+      return published()->generation.load(std::memory_order_acquire);
+    }
+    /*
+     * A copy of the json as it is now, which stays the same while the ConfigFile is reloaded, e.g. for another thread.
+     * Copies are shared until generation() changes. Not thread safe with load() or insert().
+     */
+    std::shared_ptr<const ConfigSnapshot> snapshot() {
+      auto* p = published();
+      std::lock_guard<std::mutex> lock(p->mutex);
+      if (p->snap && p->snap->generation == p->generation.load(std::memory_order_relaxed)) return p->snap;
+      return take_snapshot(*p);
+    }
+    /*
+     * Bump generation() and take a new snapshot() now, e.g. right after reloading the file
+     */
+    std::shared_ptr<const ConfigSnapshot> publish() {
+      auto* p = published();
+      std::lock_guard<std::mutex> lock(p->mutex);
+      p->generation.store(ConfigPublished::next_generation(), std::memory_order_release);
+      return take_snapshot(*p);
+    }
+    /*
+     * load() and publish() in one, for reloading a changed file at runtime
+     */
+    bool reload(const std::string& _file_path, const std::string& _cmp_id) {
+      if (!load(_file_path, _cmp_id)) return false;
+      publish();
+      return true;
     }
 
     /*
@@ -135,7 +231,84 @@ namespace VIMR {
     bool insert(std::string _key, T _val) {
       if (!j.contains(_key)) j[_key] = _val;
       else return false;
+      published()->generation.store(ConfigPublished::next_generation(), std::memory_order_release);
       return true;
     }
+
+   private:
+    /*
+     * Instance key of the SideTable entry: the json's top level object, which load() allocates anew. Reloading
+     * replaces the entry, and so does the next ConfigFile at this address if the library destroyed this one.
+     */
+    const void* root() const {
+      return j.get_ptr<const nlohmann::json::object_t*>();
+    }
+    ConfigPublished* published() {
+      if (auto* p = SideTable<ConfigPublished>::find(this, root())) return p;
+      return SideTable<ConfigPublished>::get(this, root());
+    }
+    std::shared_ptr<const ConfigSnapshot> take_snapshot(ConfigPublished& _p) {
+      auto snap = std::make_shared<ConfigSnapshot>();
+      snap->j = j;
+      snap->generation = _p.generation.load(std::memory_order_relaxed);
+      snap->loaded = loaded;
+      _p.snap = snap;
+      return snap;
+    }
+  };
+
+  /*
+   * A config value resolved once, for reading in loops, e.g.
+   *   ConfigKey<double> icp_max_dist(config, cmp_sel + "ICP:MaxDist", 0.1);
+   *   ... if (d < icp_max_dist.get()) ...
+   * get() returns the converted value and only looks the key up again when ConfigFile::generation() changes.
+   * A handle is for one thread; the ConfigFile has to outlive it.
+   */
+  template<class T>
+  class ConfigKey {
+   public:
+    ConfigKey(ConfigFile& _cfg, std::string _scoped_key, T _default) : cfg(&_cfg), scoped_key(std::move(_scoped_key)), default_value(std::move(_default)) {
+      resolve();
+    }
+    const T& get() {
+      if (cfg->generation() != generation) resolve();
+      return value;
+    }
+    operator const T&() {
+      return get();
+    }
+    /*
+     * False if the key is missing or has the wrong type, and get() returns the default
+     */
+    bool found() {
+      get();
+      return is_found;
+    }
+    const std::string& key() const {
+      return scoped_key;
+    }
+
+   private:
+    ConfigFile* cfg;
+    std::string scoped_key;
+    T default_value;
+    T value{};
+    bool is_found = false;
+    unsigned long long generation{};
+
+    void resolve() {
+      generation = cfg->generation();
+      const nlohmann::json* node = cfg->find(scoped_key);
+      is_found = false;
+      if (node) {
+        try {
+          value = node->get<T>();
+          is_found = true;
+        }
+        catch (const std::exception&) {}
+      }
+      if (!is_found) value = default_value;
+      log(is_found ? LogLvl::LogLow : LogLvl::Warn, "Config", "%s%s", scoped_key.c_str(), is_found ? "" : " (default)");
+    }
   };
-}
\ No newline at end of file
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdint>
+#include <condition_variable>
+
+#ifdef __linux__
+#include <ctime>
+#include <climits>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+namespace VIMR {
+  /*
+   * Eventcount: lets a thread sleep until some condition (which is checked outside of the eventcount) becomes
+   * true, without a mutex around the condition.
+   *
+   * A waiter registers itself and reads the current epoch (prepare_wait()), checks its condition, and only
+   * then sleeps until the epoch changes (commit_wait()). A notifier changes the state the condition depends
+   * on and then calls notify_*(), which bumps the epoch. Because the epoch is read before the condition is
+   * checked, a notify that happens in between can't be lost. notify_*() is a fence and a load when nobody
+   * is waiting.
+   *
+   * await() wraps all of that and spins for a short while first, which is enough to catch most handoffs
+   * between two busy threads without a syscall.
+   *
+   * Sleeping uses a futex on Linux and a mutex/condition_variable everywhere else.
+   */
+  class EventCount {
+   public:
+    static constexpr int default_spin_iters = 256;
+
+    uint32_t prepare_wait() {
+      n_waiters.fetch_add(1, std::memory_order_seq_cst);
+      return epoch.load(std::memory_order_seq_cst);
+    }
+    void cancel_wait() {
+      n_waiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+    void commit_wait(uint32_t _key) {
+      while (epoch.load(std::memory_order_acquire) == _key) sleep(_key, nullptr);
+      n_waiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+    /*
+     * Returns false if _deadline passed before the epoch changed
+     */
+    bool commit_wait_until(uint32_t _key, std::chrono::steady_clock::time_point _deadline) {
+      bool changed = true;
+      while (epoch.load(std::memory_order_acquire) == _key) {
+        if (std::chrono::steady_clock::now() >= _deadline) {
+          changed = false;
+          break;
+        }
+        sleep(_key, &_deadline);
+      }
+      n_waiters.fetch_sub(1, std::memory_order_seq_cst);
+      return changed;
+    }
+
+    void notify_one() {
+      notify(false);
+    }
+    void notify_all() {
+      notify(true);
+    }
+
+    /*
+     * Block until _ready() returns true. _ready() has to be safe to call from this thread at any time.
+     */
+    template<class PRED_T>
+    void await(PRED_T _ready, int _spin_iters = default_spin_iters) {
+      if (spin(_ready, _spin_iters)) return;
+      while (true) {
+        const uint32_t key = prepare_wait();
+        if (_ready()) {
+          cancel_wait();
+          return;
+        }
+        commit_wait(key);
+        if (_ready()) return;
+      }
+    }
+    /*
+     * Same as await(), but gives up after _timeout_ms. Returns _ready().
+     */
+    template<class PRED_T>
+    bool await_for(PRED_T _ready, unsigned long _timeout_ms, int _spin_iters = default_spin_iters) {
+      return await_until(_ready, std::chrono::steady_clock::now() + std::chrono::milliseconds(_timeout_ms), _spin_iters);
+    }
+    template<class PRED_T>
+    bool await_until(PRED_T _ready, std::chrono::steady_clock::time_point _deadline, int _spin_iters = default_spin_iters) {
+      if (spin(_ready, _spin_iters)) return true;
+      while (true) {
+        const uint32_t key = prepare_wait();
+        if (_ready()) {
+          cancel_wait();
+          return true;
+        }
+        if (!commit_wait_until(key, _deadline)) return _ready();
+        if (_ready()) return true;
+      }
+    }
+
+   private:
+    alignas(64) std::atomic<uint32_t> epoch{ 0 };
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex needs a plain 32-bit word");
+    std::atomic<uint32_t> n_waiters{ 0 };
+#ifndef __linux__
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_cond;
+#endif
+
+    template<class PRED_T>
+    static bool spin(PRED_T& _ready, int _spin_iters) {
+      for (int i = 0; i < _spin_iters; i++) {
+        if (_ready()) return true;
+        if (i > _spin_iters / 2) std::this_thread::yield();
+      }
+      return false;
+    }
+
+    void notify(bool _all) {
+      // Pairs with the fetch_add in prepare_wait(): either the waiter sees the new state in its _ready() check, or we see the waiter here
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (n_waiters.load(std::memory_order_relaxed) == 0) return;
+      epoch.fetch_add(1, std::memory_order_seq_cst);
+#ifdef __linux__
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch), FUTEX_WAKE_PRIVATE, _all ? INT_MAX : 1, nullptr, nullptr, 0);
+#else
+      {
+        std::lock_guard<std::mutex> sleep_lock(sleep_mutex);
+      }
+      if (_all) sleep_cond.notify_all();
+      else sleep_cond.notify_one();
+#endif
+    }
+
+    void sleep(uint32_t _key, const std::chrono::steady_clock::time_point* _deadline) {
+#ifdef __linux__
+      timespec ts{};
+      if (_deadline) {
+        const auto rem = std::chrono::duration_cast<std::chrono::nanoseconds>(*_deadline - std::chrono::steady_clock::now()).count();
+        if (rem <= 0) return;
+        ts.tv_sec = static_cast<time_t>(rem / 1000000000);
+        ts.tv_nsec = static_cast<long>(rem % 1000000000);
+      }
+      // Returns immediately if epoch != _key, spurious returns are handled by the callers' loops
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch), FUTEX_WAIT_PRIVATE, _key, _deadline ? &ts : nullptr, nullptr, 0);
+#else
+      std::unique_lock<std::mutex> sleep_lock(sleep_mutex);
+      const auto changed = [this, _key]() { return epoch.load(std::memory_order_acquire) != _key; };
+      if (_deadline) sleep_cond.wait_until(sleep_lock, *_deadline, changed);
+      else sleep_cond.wait(sleep_lock, changed);
+#endif
+    }
+  };
+}
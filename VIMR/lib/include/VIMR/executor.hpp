@@ -0,0 +1,146 @@
+#pragma once
+
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <functional>
+#include "eventcount.hpp"
+
+namespace VIMR {
+  /*
+   * A fixed-size pool of worker threads with one task deque per worker.
+   *
+   * Tasks submitted from a worker go to the back of that worker's own deque and are popped LIFO by that
+   * worker. Tasks submitted from any other thread are spread round-robin over the workers. Idle workers
+   * steal from the front of the other deques before they park.
+   *
+   * There are no ordering guarantees between tasks. Anything that needs ordering (e.g. BufferProcessor)
+   * has to make sure it only has one task in flight at a time.
+   */
+  class Executor {
+   public:
+    using Task = std::function<void(void)>;
+
+    /*
+     * _n_workers == 0 uses half of the hardware threads (at least one)
+     */
+    explicit Executor(size_t _n_workers = 0) {
+      if (_n_workers == 0) _n_workers = std::max(1u, std::thread::hardware_concurrency() / 2);
+      for (size_t i = 0; i < _n_workers; i++) workers.emplace_back(new Worker());
+      for (size_t i = 0; i < _n_workers; i++) {
+        workers[i]->thread = std::thread([this, i]() { run(i); });
+      }
+    }
+    /*
+     * Tasks still queued when the executor is destroyed are dropped. Anything that submits tasks
+     * (e.g. a BufferProcessor) must be released before the executor is destroyed.
+     */
+    ~Executor() {
+      stopping.store(true);
+      parked.notify_all();
+      for (auto& w: workers) if (w->thread.joinable()) w->thread.join();
+    }
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    void submit(Task _t) {
+      const int self = (current_executor == this) ? current_worker : -1;
+      const size_t idx = (self >= 0) ? static_cast<size_t>(self) : (next_worker.fetch_add(1, std::memory_order_relaxed) % workers.size());
+      {
+        std::lock_guard<std::mutex> q_lock(workers[idx]->mutex);
+        workers[idx]->tasks.push_back(std::move(_t));
+        num_pending.fetch_add(1, std::memory_order_seq_cst);
+      }
+      parked.notify_one();
+    }
+
+    size_t num_workers() const {
+      return workers.size();
+    }
+
+    /*
+     * Process-wide executor for BufferProcessors that don't need their own thread
+     */
+    static Executor& shared() {
+      static Executor ex;
+      return ex;
+    }
+
+   private:
+    struct Worker {
+      std::mutex mutex;
+      std::deque<Task> tasks;
+      std::thread thread;
+    };
+    static constexpr int spin_iters = 64;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> next_worker{ 0 };
+    // Number of tasks sitting in the deques, only changed with the deque's mutex held
+    std::atomic<long> num_pending{ 0 };
+    std::atomic<bool> stopping{ false };
+    EventCount parked;
+
+    static inline thread_local const Executor* current_executor = nullptr;
+    static inline thread_local int current_worker = -1;
+
+    bool try_pop(size_t _idx, Task& _t) {
+      auto& w = *workers[_idx];
+      std::lock_guard<std::mutex> q_lock(w.mutex);
+      if (w.tasks.empty()) return false;
+      _t = std::move(w.tasks.back());
+      w.tasks.pop_back();
+      num_pending.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+    /*
+     * _block false skips deques whose owner currently holds the lock
+     */
+    bool try_steal(size_t _thief, Task& _t, bool _block) {
+      for (size_t k = 1; k < workers.size(); k++) {
+        auto& w = *workers[(_thief + k) % workers.size()];
+        std::unique_lock<std::mutex> q_lock(w.mutex, std::defer_lock);
+        if (_block) q_lock.lock();
+        else if (!q_lock.try_lock()) continue;
+        if (w.tasks.empty()) continue;
+        _t = std::move(w.tasks.front());
+        w.tasks.pop_front();
+        num_pending.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+      }
+      return false;
+    }
+    bool find_task(size_t _idx, Task& _t, bool _block = false) {
+      return try_pop(_idx, _t) || try_steal(_idx, _t, _block);
+    }
+    void run(size_t _idx) {
+      current_executor = this;
+      current_worker = static_cast<int>(_idx);
+      Task t;
+      while (!stopping.load(std::memory_order_relaxed)) {
+        bool found = false;
+        for (int i = 0; i < spin_iters && !found; i++) {
+          found = find_task(_idx, t);
+          if (!found && num_pending.load(std::memory_order_relaxed) == 0) break;
+        }
+        /*
+         * A failed sweep with num_pending > 0 means every steal lost its try_lock. Sweep once more taking
+         * the locks, so that parking below is only skipped when a task really arrived after the sweep.
+         */
+        if (!found && num_pending.load(std::memory_order_relaxed) > 0) found = find_task(_idx, t, true);
+        if (found) {
+          t();
+          t = nullptr;
+          continue;
+        }
+        // Already spun above, so park straight away
+        parked.await([this]() {
+          return num_pending.load(std::memory_order_seq_cst) > 0 || stopping.load();
+        }, 0);
+      }
+    }
+  };
+}
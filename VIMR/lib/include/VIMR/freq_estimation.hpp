@@ -12,10 +12,20 @@
 #include <iomanip> // for std::setprecision
 #include <ios>     // for std::fixed
 
-// don't change to system_clock - system time can go backwards
+// Wall clock, which can jump. Only for timestamps that have to be comparable across runs (e.g. message ids),
+// use steady_ms_now() / steady_us_now() to measure time.
 #define ms_now std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count()
 
 namespace VIMR {
+  /*
+   * Monotonic time since an unspecified epoch (usually boot), which differs between machines (see ClockSync)
+   */
+  inline long long steady_us_now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+  inline long long steady_ms_now() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
   template<typename T>
   std::string to_string(const T _v, int _decimals) {
     std::stringstream stream;
@@ -97,10 +107,10 @@ namespace VIMR {
   public:
     double update() {
       if (last_ms < 0) {
-        last_ms = ms_now;
+        last_ms = steady_ms_now();
         return 0;
       }
-      const long long now = ms_now;
+      const long long now = steady_ms_now();
       const auto period =double(now - last_ms);
       last_ms = now;
 
@@ -2,6 +2,7 @@
 #include <json.hpp>
 #include "vimr_api.hpp"
 #include "voxelvideo.hpp"
+#include "queue_stats.hpp"
 
 using nlohmann::json;
 
@@ -11,4 +12,18 @@ namespace VIMR
   VIMR_INTERFACE void to_json(nlohmann::json& j, const VoxelVideo::AudioStream& p);
   VIMR_INTERFACE void from_json(const nlohmann::json& j, VoxelVideo::Metadata& p);
   VIMR_INTERFACE void to_json(nlohmann::json& j, const VoxelVideo::Metadata& p);
+
+  inline void to_json(nlohmann::json& j, const QueueStats::Snapshot& p)
+  {
+    j["name"] = p.name;
+    j["capacity"] = p.capacity;
+    j["in"] = p.n_in;
+    j["out"] = p.n_out;
+    j["dropped"] = p.n_dropped;
+    j["occupancy"] = std::vector<uint64_t>(std::begin(p.occupancy), std::end(p.occupancy));
+    j["blocked_ms"] = p.producer_blocked_ns * 1e-6;
+    j["idle_ms"] = p.consumer_idle_ns * 1e-6;
+    j["processing_ms"] = p.processing_ns * 1e-6;
+    j["processing_max_ms"] = p.processing_max_ns * 1e-6;
+  }
 }
@@ -0,0 +1,221 @@
+#pragma once
+
+#include "octree.hpp"
+#include "voxencoding.hpp"
+#include "serialbuffer.hpp"
+#include "bitstream.hpp"
+#include <vector>
+
+namespace VIMR {
+  /*
+   * Compresses the per-voxel label channel (e.g. VoxelBody body part IDs) using the octree structure.
+   *
+   * Internal nodes whose leaves all share a label are stored once (one flag bit and the label), the
+   * tree is only descended into where labels are mixed. The resulting sequence of labels (uniform
+   * subtrees and the remaining individual leaves) is run-length coded.
+   *
+   * The decoder needs the same octree structure (i.e. decode after Octree::unpack()) since the labels
+   * are assigned by walking the tree in the same order as the encoder.
+   *
+   * Serial layout: uint8 label bits, uint32 n bytes, bit stream
+   */
+  class HierarchicalLabels {
+   public:
+    template<typename GET_F>
+    bool encode(Voxel* _root, uint8_t _label_bits, GET_F _get_label, BufWriter* _dst) {
+      node_label.clear();
+      node_size.clear();
+      symbols.clear();
+      bits.reset();
+      run_ctx = RiceContext{};
+      run_remaining = 0;
+      if (_root) {
+        find_uniform(_root, _get_label);
+        size_t p = 0;
+        collect_symbols(_root, _get_label, p);
+        p = 0;
+        size_t s = 0;
+        emit(_root, _label_bits, p, s);
+      }
+      bits.flush();
+      const auto n_bytes = static_cast<uint32_t>(bits.size());
+      if (!_dst->put(_label_bits)) return false;
+      if (!_dst->put(n_bytes)) return false;
+      return _dst->put(reinterpret_cast<const char*>(bits.bytes()), n_bytes);
+    }
+
+    template<typename SET_F>
+    bool decode(BufReader* _src, Voxel* _root, SET_F _set_label) {
+      uint8_t label_bits;
+      uint32_t n_bytes;
+      if (!_src->pop(label_bits)) return false;
+      if (!_src->pop(n_bytes)) return false;
+      if (_src->read_headroom() < n_bytes) return false;
+      BitReader in(reinterpret_cast<const uint8_t*>(_src->read_ptr()), n_bytes);
+      run_remaining = 0;
+      run_ctx = RiceContext{};
+      if (_root) read_node(in, _root, label_bits, _set_label);
+      if (in.overrun()) return false;
+      tmp_skip.resize(n_bytes);
+      return _src->pop(tmp_skip.data(), n_bytes);
+    }
+
+    bool encode(Octree& _o, VoxelEncoding& _e, BufWriter* _dst) {
+      const int n_bytes = _e.get_num_label_bytes();
+      return encode(find_root(_o), static_cast<uint8_t>(8 * n_bytes), [&_e, n_bytes](Voxel* _v) {
+        return get_label_bytes(_e, _v, n_bytes);
+      }, _dst);
+    }
+
+    bool decode(BufReader* _src, Octree& _o, VoxelEncoding& _e) {
+      const int n_bytes = _e.get_num_label_bytes();
+      return decode(_src, find_root(_o), [&_e, n_bytes](Voxel* _v, uint32_t _l) {
+        set_label_bytes(_e, _v, n_bytes, _l);
+      });
+    }
+
+    static Voxel* find_root(Octree& _o) {
+      if (_o.begin() == _o.end()) return nullptr;
+      Voxel* v = *_o.begin();
+      while (v->parent) v = v->parent;
+      return v;
+    }
+    static uint32_t get_label_bytes(VoxelEncoding& _e, Voxel* _v, int _n_bytes) {
+      switch (_n_bytes) {
+        case 1: return _e.get_label<uint8_t>(_v);
+        case 2: return _e.get_label<uint16_t>(_v);
+        case 3: {
+          uint32_t l = 0;
+          _e.get_label_bytes(_v, &l, 3);
+          return l;
+        }
+        case 4: return _e.get_label<uint32_t>(_v);
+        default: return 0;
+      }
+    }
+    static void set_label_bytes(VoxelEncoding& _e, Voxel* _v, int _n_bytes, uint32_t _l) {
+      switch (_n_bytes) {
+        case 1: _e.set_label<uint8_t>(_v, static_cast<uint8_t>(_l)); break;
+        case 2: _e.set_label<uint16_t>(_v, static_cast<uint16_t>(_l)); break;
+        case 3: _e.set_label_bytes(_v, &_l, 3); break;
+        case 4: _e.set_label<uint32_t>(_v, _l); break;
+        default: break;
+      }
+    }
+
+   private:
+    static constexpr int64_t mixed = -1;
+    // Uniform label (or mixed) and number of internal nodes in the subtree of every internal node, in pre-order
+    std::vector<int64_t> node_label{};
+    std::vector<size_t> node_size{};
+    // Labels in the order they are emitted
+    std::vector<uint32_t> symbols{};
+    BitWriter bits{};
+    RiceContext run_ctx{};
+    uint32_t run_remaining = 0;
+    uint32_t run_label = 0;
+    std::vector<char> tmp_skip{};
+
+    static bool is_leaf(const Voxel* _v) {
+      for (const auto* c: _v->children) if (c) return false;
+      return true;
+    }
+
+    template<typename GET_F>
+    int64_t find_uniform(Voxel* _v, GET_F& _get_label) {
+      if (is_leaf(_v)) return _get_label(_v);
+      const size_t idx = node_label.size();
+      node_label.push_back(mixed);
+      node_size.push_back(0);
+      int64_t l = -2;
+      for (auto* c: _v->children) {
+        if (!c) continue;
+        const auto cl = find_uniform(c, _get_label);
+        if (l == -2) l = cl;
+        else if (cl != l) l = mixed;
+      }
+      node_label[idx] = l;
+      node_size[idx] = node_label.size() - idx;
+      return l;
+    }
+
+    template<typename GET_F>
+    void collect_symbols(Voxel* _v, GET_F& _get_label, size_t& _p) {
+      if (is_leaf(_v)) {
+        symbols.push_back(_get_label(_v));
+        return;
+      }
+      const auto l = node_label[_p];
+      if (l != mixed) {
+        symbols.push_back(static_cast<uint32_t>(l));
+        _p += node_size[_p];
+        return;
+      }
+      _p++;
+      for (auto* c: _v->children) if (c) collect_symbols(c, _get_label, _p);
+    }
+
+    void put_symbol(size_t& _s, uint8_t _label_bits) {
+      if (run_remaining == 0) {
+        size_t e = _s + 1;
+        while (e < symbols.size() && symbols[e] == symbols[_s]) e++;
+        const auto len = static_cast<uint32_t>(e - _s);
+        bits.put(symbols[_s], _label_bits);
+        bits.put_rice(len - 1, run_ctx.k());
+        run_ctx.update(len - 1);
+        run_remaining = len;
+      }
+      run_remaining--;
+      _s++;
+    }
+
+    void emit(Voxel* _v, uint8_t _label_bits, size_t& _p, size_t& _s) {
+      if (is_leaf(_v)) {
+        put_symbol(_s, _label_bits);
+        return;
+      }
+      const bool uniform = node_label[_p] != mixed;
+      bits.put_bit(uniform);
+      if (uniform) {
+        put_symbol(_s, _label_bits);
+        _p += node_size[_p];
+        return;
+      }
+      _p++;
+      for (auto* c: _v->children) if (c) emit(c, _label_bits, _p, _s);
+    }
+
+    uint32_t get_symbol(BitReader& _in, uint8_t _label_bits) {
+      if (run_remaining == 0) {
+        run_label = _in.get(_label_bits);
+        const auto len = _in.get_rice(run_ctx.k()) + 1;
+        run_ctx.update(len - 1);
+        run_remaining = len;
+      }
+      run_remaining--;
+      return run_label;
+    }
+
+    template<typename SET_F>
+    static void fill(Voxel* _v, uint32_t _l, SET_F& _set_label) {
+      if (is_leaf(_v)) {
+        _set_label(_v, _l);
+        return;
+      }
+      for (auto* c: _v->children) if (c) fill(c, _l, _set_label);
+    }
+
+    template<typename SET_F>
+    void read_node(BitReader& _in, Voxel* _v, uint8_t _label_bits, SET_F& _set_label) {
+      if (is_leaf(_v)) {
+        _set_label(_v, get_symbol(_in, _label_bits));
+        return;
+      }
+      if (_in.get_bit()) {
+        fill(_v, get_symbol(_in, _label_bits), _set_label);
+        return;
+      }
+      for (auto* c: _v->children) if (c) read_node(_in, c, _label_bits, _set_label);
+    }
+  };
+}
@@ -8,84 +8,425 @@
 #include "serialbuffer.hpp"
 #include "freq_estimation.hpp"
 #include "netstream_fragmenter.hpp"
+#include "clock_sync.hpp"
+#include "netstream_loopback.hpp"
+#include "side_table.hpp"
 
 
 namespace VIMR {
   namespace Network {
+    /*
+     * Transport of a VNetStream built with the loopback constructor. vimr.dll builds VNetStreams too, so the stream's
+     * layout can't change and this lives in a SideTable keyed on the stream (and its assembler).
+     */
+    struct VNetStreamLoopback {
+      std::unique_ptr<LoopbackNet> net;
+    };
+    /*
+     * A VNetStream's view of its peer's clock (see VNetStream::enable_clock_sync()), in a SideTable for the same
+     * reason. Created by enable_clock_sync() or when the peer sends a capture time.
+     */
+    struct VNetStreamClock {
+      ClockSync clock_sync;
+      std::atomic<int64_t> probe_interval_us{ 0 };
+      // Only used on the receive thread
+      int64_t next_probe_us = 0;
+      // The peer's latest FrameTimes, at frame_number % n_frame_times
+      static constexpr size_t n_frame_times = 64;
+      std::mutex frame_time_mutex;
+      FrameTime frame_times[n_frame_times]{};
+    };
+
+    /*
+     * Message stream to one peer, over VNet, or over a LoopbackNet (netstream_loopback.hpp) to run the same pipeline
+     * inside one process without a VNet server.
+     */
     template<class SERIAL_T>
     class VNetStream {
       string peer_id;
       std::mutex send_mutex;
+      // nullptr for loopback streams, see loopback()
       VNet* vnet_impl = nullptr;
       MessageFragmenter* fragment_sender;
       MessageAssembler<SERIAL_T>* fragment_assembler;
+
+      /*
+       * nullptr until there is clock state, see VNetStreamClock
+       */
+      VNetStreamClock* clock() const {
+        return SideTable<VNetStreamClock>::find(this, fragment_assembler);
+      }
+      VNetStreamClock* get_clock() {
+        if (auto* c = clock()) return c;
+        return SideTable<VNetStreamClock>::get(this, fragment_assembler);
+      }
+
+      void on_control(uint16_t _type, const char* _d, size_t _n) {
+        const int64_t now = steady_us_now();
+        if (_type == Control::clock_probe) {
+          if (_n < sizeof(ClockProbe)) return;
+          ClockProbe p;
+          memcpy(&p, _d, sizeof(p));
+          ClockReply r;
+          r.t_probe_us = p.t_sent_us;
+          r.t_received_us = now;
+          std::lock_guard send_lock(send_mutex);
+          r.t_sent_us = steady_us_now();
+          fragment_sender->send_control(peer_id, Control::clock_reply, &r, sizeof(r));
+        }
+        else if (_type == Control::clock_reply) {
+          if (_n < sizeof(ClockReply)) return;
+          auto* c = clock();
+          if (!c) return;
+          ClockReply r;
+          memcpy(&r, _d, sizeof(r));
+          c->clock_sync.add_sample(r.t_probe_us, r.t_received_us, r.t_sent_us, now);
+        }
+        else if (_type == Control::frame_time) {
+          if (_n < sizeof(FrameTime)) return;
+          FrameTime t;
+          memcpy(&t, _d, sizeof(t));
+          auto* c = get_clock();
+          std::lock_guard lock(c->frame_time_mutex);
+          c->frame_times[static_cast<uint64_t>(t.frame_number) % VNetStreamClock::n_frame_times] = t;
+        }
+      }
+      /*
+       * On the receive thread, after every datagram. Probes ten times as often until the clock is synced.
+       */
+      void maybe_probe_clock() {
+        auto* c = clock();
+        if (!c) return;
+        const int64_t interval = c->probe_interval_us.load(std::memory_order_relaxed);
+        if (!interval) return;
+        const int64_t now = steady_us_now();
+        if (now < c->next_probe_us) return;
+        c->next_probe_us = now + (c->clock_sync.synced() ? interval : interval / 10);
+        ClockProbe p;
+        std::lock_guard send_lock(send_mutex);
+        p.t_sent_us = steady_us_now();
+        fragment_sender->send_control(peer_id, Control::clock_probe, &p, sizeof(p));
+      }
      public:
       VNetStream(const char* _vnet_addr, const char* _id, const char* _peer, bool _lan, RingBuffer<SERIAL_T>* _consumer = nullptr, int _poll_ms = 1500, int _max_attempts = -1) {
         peer_id = string(_peer);
 
         fragment_assembler = new MessageAssembler(peer_id, _consumer);
+        // Before the transport, which may call on_control() as soon as it exists
+        fragment_sender = new MessageFragmenter([this](BufReader * _n){ return vnet_impl->send_to_peer(_n); }, (peer_id + ":fragmenter").c_str());
+        fragment_assembler->set_control_handler([this](uint16_t _type, const char* _d, size_t _n) { on_control(_type, _d, _n); });
         vnet_impl = new VNet(_id, _peer, _lan, [this](const char* _d, const uintptr_t _d_len) {
-          fragment_assembler->current_head()->from(_d, _d_len);
-          if (!fragment_assembler->try_advance_head())
-            log(LogLvl::Warn, "NS", "%s Fragment receive buffer is full. Re-using current fragment buffer.", peer_id.c_str());
+          if (fragment_assembler->receive(_d, _d_len)) maybe_probe_clock();
         });
-        fragment_sender = new MessageFragmenter([this](BufReader * _n){ return vnet_impl->send_to_peer(_n); } );
 
         if (!vnet_impl->connect_and_start_pairing(_vnet_addr) || !start_pairing(_poll_ms, _max_attempts)) {
           throw std::exception();
         }
       }
+      /*
+       * Over a LoopbackNet instead of VNet, e.g.
+       *
+       *   VNetStream<SerialMessage> tx(use_loopback, LoopbackNet::inproc, "cam", "merge", true);
+       *   VNetStream<SerialMessage> rx(use_loopback, LoopbackNet::inproc, "merge", "cam", true, &consumer);
+       *
+       * _mode: LoopbackNet::inproc or LoopbackNet::udp. The streams pair as soon as both ends exist.
+       */
+      VNetStream(UseLoopback, const char* _mode, const char* _id, const char* _peer, bool _lan, RingBuffer<SERIAL_T>* _consumer = nullptr) {
+        peer_id = string(_peer);
+
+        fragment_assembler = new MessageAssembler(peer_id, _consumer);
+        auto* lb = SideTable<VNetStreamLoopback>::get(this, fragment_assembler);
+        lb->net = std::make_unique<LoopbackNet>(_id, _peer, _lan, [this](const char* _d, const uintptr_t _d_len) {
+          if (fragment_assembler->receive(_d, _d_len)) maybe_probe_clock();
+        });
+        // Nothing is received before connect_and_start_pairing()
+        fragment_sender = new MessageFragmenter([net = lb->net.get()](BufReader * _n){ return net->send_to_peer(_n); }, (peer_id + ":fragmenter").c_str());
+        fragment_assembler->set_control_handler([this](uint16_t _type, const char* _d, size_t _n) { on_control(_type, _d, _n); });
+
+        if (!lb->net->connect_and_start_pairing(_mode)) {
+          SideTable<VNetStreamLoopback>::erase(this, fragment_assembler);
+          delete fragment_sender;
+          delete fragment_assembler;
+          throw std::exception();
+        }
+      }
       ~VNetStream() {
         fragment_sender->release();
         fragment_assembler->release();
-        delete fragment_assembler;
+        // The assembler, and through its control handler the sender, are called from the transport's receive thread,
+        // so both have to outlive it
+        if (vnet_impl) delete vnet_impl;
+        else SideTable<VNetStreamLoopback>::erase(this, fragment_assembler);
+        SideTable<VNetStreamClock>::erase(this, fragment_assembler);
         delete fragment_sender;
-        delete vnet_impl;
+        delete fragment_assembler;
       }
       bool send(BufReader* _b) {
         std::lock_guard send_lock(send_mutex);
-        return fragment_sender->send(peer_id, _b, vnet_impl->max_frag_payload());
+        return fragment_sender->send(peer_id, _b, frag_payload_size());
+      }
+      /*
+       * Queues a message which was already fragmented for frag_payload_size() (see MultiStream)
+       */
+      bool send(FragmentSetPtr _set) {
+        std::lock_guard send_lock(send_mutex);
+        return fragment_sender->send(peer_id, std::move(_set));
+      }
+      size_t frag_payload_size() const {
+        return vnet_impl ? vnet_impl->max_frag_payload() : loopback()->max_frag_payload();
+      }
+      size_t get_fec_group_size() const {
+        return fragment_sender->get_fec_group_size();
+      }
+      /*
+       * Probe the peer's clock every _interval_ms (0 = stop) while datagrams arrive from it, see get_clock_sync().
+       * The peer answers probes on its own, it doesn't have to enable anything.
+       */
+      void enable_clock_sync(unsigned long _interval_ms = 1000) {
+        get_clock()->probe_interval_us.store(static_cast<int64_t>(_interval_ms) * 1000, std::memory_order_relaxed);
+      }
+      /*
+       * The peer's steady clock relative to ours, nullptr before enable_clock_sync()
+       */
+      const ClockSync* get_clock_sync() const {
+        const auto* c = clock();
+        return c ? &c->clock_sync : nullptr;
+      }
+      /*
+       * From _peer_time_us (steady_us_now() on the peer) to now. False until the clocks are synced.
+       */
+      bool one_way_latency_ms(int64_t _peer_time_us, double* _ms_out) const {
+        const auto* c = clock();
+        if (!c || !c->clock_sync.synced()) return false;
+        *_ms_out = 1e-3 * static_cast<double>(steady_us_now() - c->clock_sync.to_local_us(_peer_time_us));
+        return true;
+      }
+      /*
+       * Tell the peer when the frame with _frame_number (VoxelMessage::frame_number) was captured, for its
+       * frame_latency_ms(). Send it before the frame, the peer looks it up by frame number when the frame arrives.
+       */
+      bool send_capture_time(int64_t _frame_number, int64_t _capture_time_us) {
+        const FrameTime t{ _frame_number, _capture_time_us };
+        std::lock_guard send_lock(send_mutex);
+        return fragment_sender->send_control(peer_id, Control::frame_time, &t, sizeof(t));
+      }
+      /*
+       * From the capture of the peer's frame _frame_number (see send_capture_time()) to now. False until the clocks
+       * are synced, or if the peer hasn't sent the capture time of _frame_number (only the last 64 are kept).
+       */
+      bool frame_latency_ms(int64_t _frame_number, double* _ms_out) const {
+        auto* c = clock();
+        if (!c) return false;
+        int64_t capture_time_us;
+        {
+          std::lock_guard lock(c->frame_time_mutex);
+          const auto& t = c->frame_times[static_cast<uint64_t>(_frame_number) % VNetStreamClock::n_frame_times];
+          if (t.frame_number != _frame_number || !t.capture_time_us) return false;
+          capture_time_us = t.capture_time_us;
+        }
+        return one_way_latency_ms(capture_time_us, _ms_out);
+      }
+      /*
+       * See MessageFragmenter::set_send_rate()
+       */
+      void set_send_rate(double _bytes_per_sec, double _burst_bytes = 0) {
+        fragment_sender->set_send_rate(_bytes_per_sec, _burst_bytes);
+      }
+      /*
+       * See MessageFragmenter::set_fec_group_size()
+       */
+      void set_fec_group_size(size_t _group_size) {
+        fragment_sender->set_fec_group_size(_group_size);
+      }
+      /*
+       * See MessageFragmenter::set_admission()
+       */
+      void set_admission(Admission _policy, double _max_delay_s = 0) {
+        fragment_sender->set_admission(_policy, _max_delay_s);
+      }
+      uint64_t get_admission_drops() const {
+        return fragment_sender->get_admission_drops();
+      }
+      uint64_t get_queue_drops() const {
+        return fragment_sender->get_queue_drops();
+      }
+      /*
+       * Send through _scheduler in _lane from now on (see SendScheduler)
+       */
+      void set_scheduler(SendScheduler* _scheduler, SendLane _lane, unsigned _weight = 1) {
+        std::lock_guard send_lock(send_mutex);
+        fragment_sender->use_scheduler(_scheduler, _lane, peer_id, _weight);
+      }
+      void set_weight(unsigned _weight) {
+        fragment_sender->set_weight(_weight);
       }
       bool start_pairing(int _poll_ms = 1000, int _max_attempts = -1) const {
-        return vnet_impl->start_pairing(_poll_ms, _max_attempts);
+        return vnet_impl ? vnet_impl->start_pairing(_poll_ms, _max_attempts) : loopback()->start_pairing(_poll_ms, _max_attempts);
       }
       bool is_paired() const {
-        return vnet_impl->is_paired();
+        return vnet_impl ? vnet_impl->is_paired() : loopback()->is_paired();
+      }
+      /*
+       * The LoopbackNet of a stream built with the loopback constructor (e.g. to set an impairment before the first
+       * send), nullptr for VNet streams
+       */
+      LoopbackNet* loopback() const {
+        if (vnet_impl) return nullptr;
+        auto* lb = SideTable<VNetStreamLoopback>::find(this, fragment_assembler);
+        return lb ? lb->net.get() : nullptr;
       }
     };
 
+    /*
+     * MultiStream's settings for current and future streams, and its fragmenting state. Component embeds a MultiStream
+     * and vimr.dll constructs Component, so these live in a SideTable instead of in MultiStream.
+     */
+    struct MultiStreamOptions {
+      double send_rate = 0;
+      double send_burst = 0;
+      bool has_send_rate = false;
+      size_t fec_group_size = 0;
+      Admission admission = Admission::QueueAll;
+      double max_delay_s = 0;
+      unsigned long clock_sync_interval_ms = 0;
+      SendScheduler* scheduler = nullptr;
+      SendLane scheduler_lane = SendLane::Bulk;
+      FragmentSetPool fragment_pool;
+      std::vector<FragmentSetPtr> frame_sets;
+    };
+
     template<class SERIAL_T>
     class MultiStream : public BufferProcessor<SERIAL_T> {
+      /*
+       * Every message is fragmented once per distinct fragment size / FEC setting, and each stream's sender only
+       * gets a reference to the shared fragments
+       */
       void send_to_all(BufReader* _msg) {
+        auto* o = options();
+        o->frame_sets.clear();
         for (auto&[id, strm]: streams) {
           if (strm->is_paired() && enabled[id]) {
-            strm->send(_msg);
+            if (auto set = fragments_for(o, _msg, strm->frag_payload_size(), strm->get_fec_group_size())) strm->send(std::move(set));
           }
         }
         for(auto&[id, strm]: udp_streams)
         {
-          strm->queue(_msg);
+          if (auto set = fragments_for(o, _msg, strm->frag_payload_size(), strm->get_fec_group_size())) strm->queue(std::move(set));
         }
+        o->frame_sets.clear();
+      }
+      static FragmentSetPtr fragments_for(MultiStreamOptions* _o, BufReader* _msg, size_t _frag_size, size_t _fec_group_size) {
+        for (auto& s: _o->frame_sets) {
+          if (s->frag_size == _frag_size && s->fec_group_size == _fec_group_size) return s;
+        }
+        auto set = _o->fragment_pool.get();
+        if (!set->build(_msg, _frag_size, _fec_group_size)) {
+          log(LogLvl::Fatal, "NS", "multistream message of %zu bytes can't be fragmented into %zu byte datagrams", _msg->size(), _frag_size);
+          return nullptr;
+        }
+        _o->frame_sets.push_back(set);
+        return set;
+      }
+      MultiStreamOptions* options() {
+        if (auto* o = SideTable<MultiStreamOptions>::find(this, this->instance_key())) return o;
+        return SideTable<MultiStreamOptions>::get(this, this->instance_key());
       }
      public:
-      MultiStream() : BufferProcessor<SERIAL_T>(8, [this](SERIAL_T* _src) {
+      /*
+       * Fragments on Executor::shared() instead of a thread of its own, sending only queues the fragments with
+       * each stream's sender.
+       * _stats_name: see BufferProcessor, give every MultiStream its own (e.g. component and stream ids)
+       */
+      explicit MultiStream(const char* _stats_name = nullptr) : BufferProcessor<SERIAL_T>(8, [this](SERIAL_T* _src) {
         send_to_all(_src);
-      }) {
+      }, &Executor::shared(), _stats_name) {
       }
       ~MultiStream() {
-        for (auto &[id, strm]: streams) delete strm;
+        // Before the streams go, a drain task may still be sending to them
         this->release();
+        for (auto &[id, strm]: streams) delete strm;
+        SideTable<MultiStreamOptions>::erase(this, this->instance_key());
       }
 			bool has(const string& _id) {
 				return streams.count(_id) > 0;
 			}
+      /*
+       * See VNetStream::enable_clock_sync(). Applies to every VNet stream, current and future.
+       */
+      void enable_clock_sync(unsigned long _interval_ms = 1000) {
+        options()->clock_sync_interval_ms = _interval_ms;
+        for (auto&[id, strm]: streams) strm->enable_clock_sync(_interval_ms);
+      }
       void add_peer(const string& _id, VNetStream<SERIAL_T>* _ns, bool _enabled = true) {
 				if(streams.count(_id) <= 0)
 				{
 					streams[_id] = _ns;
 					enabled[_id] = _enabled;
+					const auto* o = options();
+					if (o->has_send_rate) _ns->set_send_rate(o->send_rate, o->send_burst);
+					if (o->fec_group_size) _ns->set_fec_group_size(o->fec_group_size);
+					if (o->admission != Admission::QueueAll) _ns->set_admission(o->admission, o->max_delay_s);
+					if (o->clock_sync_interval_ms) _ns->enable_clock_sync(o->clock_sync_interval_ms);
+					if (o->scheduler) _ns->set_scheduler(o->scheduler, o->scheduler_lane);
 				}
       }
+      /*
+       * Applies to every stream, current and future. Each stream is paced separately, so this is the rate per peer.
+       */
+      void set_send_rate(double _bytes_per_sec, double _burst_bytes = 0) {
+        auto* o = options();
+        o->send_rate = _bytes_per_sec;
+        o->send_burst = _burst_bytes;
+        o->has_send_rate = true;
+        for (auto&[id, strm]: streams) strm->set_send_rate(_bytes_per_sec, _burst_bytes);
+        for (auto&[id, strm]: udp_streams) strm->set_send_rate(_bytes_per_sec, _burst_bytes);
+      }
+      /*
+       * Parity fragments per message for every stream, current and future (see MessageFragmenter::set_fec_group_size())
+       */
+      void set_fec_group_size(size_t _group_size) {
+        options()->fec_group_size = _group_size;
+        for (auto&[id, strm]: streams) strm->set_fec_group_size(_group_size);
+        for (auto&[id, strm]: udp_streams) strm->set_fec_group_size(_group_size);
+      }
+      /*
+       * What every stream, current and future, does with a frame it can't send before the next one is due
+       * (see MessageFragmenter::set_admission()). Each peer decides on its own, so a slow peer skips frames
+       * without holding back the others.
+       */
+      void set_admission(Admission _policy, double _max_delay_s = 0) {
+        auto* o = options();
+        o->admission = _policy;
+        o->max_delay_s = _max_delay_s;
+        for (auto&[id, strm]: streams) strm->set_admission(_policy, _max_delay_s);
+        for (auto&[id, strm]: udp_streams) strm->set_admission(_policy, _max_delay_s);
+      }
+      /*
+       * Send every stream, current and future, through _scheduler in _lane (see SendScheduler).
+       * UDP streams that were already added must not be sending yet.
+       */
+      void set_scheduler(SendScheduler* _scheduler, SendLane _lane) {
+        auto* o = options();
+        o->scheduler = _scheduler;
+        o->scheduler_lane = _lane;
+        for (auto&[id, strm]: streams) strm->set_scheduler(_scheduler, _lane);
+        for (auto&[id, strm]: udp_streams) strm->set_scheduler(_scheduler, _lane);
+      }
+      /*
+       * VNetStream::send_capture_time() to every paired and enabled peer
+       */
+      void send_capture_time(int64_t _frame_number, int64_t _capture_time_us) {
+        for (auto&[id, strm]: streams) {
+          if (strm->is_paired() && enabled[id]) strm->send_capture_time(_frame_number, _capture_time_us);
+        }
+      }
+      /*
+       * Share of the scheduler's bulk lane for peer _id relative to the other peers (default 1)
+       */
+      void set_peer_weight(const string& _id, unsigned _weight) {
+        if (streams.count(_id)) streams[_id]->set_weight(_weight);
+        else if (udp_streams.count(_id)) udp_streams[_id]->set_weight(_weight);
+      }
       void add_udpstream(const string& _addr, const string& _port, bool _lan)
       {
         const auto id="UDP:" + _addr + ":" + _port;
@@ -100,12 +441,32 @@ namespace VIMR {
           {
             log(LogLvl::Log, "NS", "%s successfully initialised", id.c_str());
             udp_streams[id] = news;
+            const auto* o = options();
+            if (o->has_send_rate) news->set_send_rate(o->send_rate, o->send_burst);
+            if (o->fec_group_size) news->set_fec_group_size(o->fec_group_size);
+            if (o->admission != Admission::QueueAll) news->set_admission(o->admission, o->max_delay_s);
+            if (o->scheduler) news->set_scheduler(o->scheduler, o->scheduler_lane);
           }
         }catch(std::exception &_e)
         {
           log(LogLvl::Fatal, "NS", "%s failed to init UDP socket: %s", id.c_str(), _e.what());
         }
       }
+#ifdef __linux__
+      /*
+       * LAN multicast to every viewer of _instance_id that joined with
+       *   UDPNetReceiver<SERIAL_T>(multicast_group(_instance_id), _port, consumer)
+       * Each fragment is sent once, however many viewers there are. Set a send rate: at the default pacing of one
+       * fragment per 700us the MTU sized datagrams carry only about 2 MB/s (see bench_netstream()).
+       */
+      void add_multicast(const string& _instance_id, const string& _port)
+      {
+        const auto group = multicast_group(_instance_id);
+        log(LogLvl::Log, "NS", "%s multicasting to %s:%s", _instance_id.c_str(), group.c_str(), _port.c_str());
+        // MTU sized datagrams: losing one IP fragment of a LAN sized datagram would lose all of it, for every viewer
+        add_udpstream(group, _port, false);
+      }
+#endif
       std::map<string, VNetStream<SERIAL_T>*> streams;
       std::map<string, UDPNetStream*> udp_streams;
       std::map<string, bool> enabled;
@@ -0,0 +1,334 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include "netstream.hpp"
+#include "netstream_loopback.hpp"
+#include "netstream_impairment.hpp"
+#include "netstream_scheduler.hpp"
+#include "voxelvideo_player.hpp"
+#include "pacer.hpp"
+
+namespace VIMR {
+  namespace Network {
+    struct NetBenchConfig {
+      ImpairmentConfig link{};
+      // Frames per second to send at, 0 = as fast as the sender queue takes them
+      double fps = 30;
+      size_t fec_group_size = 0;
+      // Bytes/s per peer, see MessageFragmenter::set_send_rate() (-1 = default pacing, 0 = unpaced)
+      double send_rate = -1;
+      // What the sender does with frames it can't send in time, see MessageFragmenter::set_admission()
+      Admission admission = Admission::QueueAll;
+      double max_delay_ms = 0;
+      // Send the frames (bulk lane) and poses (priority lane) through one SendScheduler paced at send_rate, instead
+      // of pacing each stream on its own
+      bool use_scheduler = false;
+      // Also send 128 byte poses at this rate (0 = none) to a second peer, over an unimpaired link
+      double pose_fps = 0;
+      // Linux: multicast the frames (see MultiStream::add_multicast()) to a UDPNetReceiver on this port instead of
+      // sending them over a LoopbackNet, so link impairments don't apply (nullptr = loopback)
+      const char* multicast_port = nullptr;
+      // Loopback only: sync the receiver to the sender's clock every clock_sync_ms (0 = off) and send the capture
+      // time of every frame, to compare VNetStream::frame_latency_ms() with the real latency. The link impairments
+      // only apply from sender to receiver, so the synced clock is off by about half of link.delay_ms.
+      unsigned clock_sync_ms = 0;
+      bool lan = true;
+      const char* mode = LoopbackNet::inproc;
+      // How long to wait for the last frames after sending
+      unsigned drain_ms = 1000;
+      // Optional, called on every delivered frame (e.g. VoxelMessage::unpack()), its time counts towards latency
+      std::function<bool(BufReader*)> decode;
+    };
+
+    struct NetBenchResult {
+      size_t frames_sent{};
+      size_t frames_delivered{};
+      // Not sent because a sender queue (the stream's or the fragmenter's) was full, or dropped or replaced by admission control
+      size_t frames_dropped_sender{};
+      // Delivered, but different from what was sent or failed to decode
+      size_t frames_corrupt{};
+      double delivery_rate{};
+      // From handing the frame to the sender to it being reassembled (and decoded)
+      double latency_p50_ms{};
+      double latency_p95_ms{};
+      double latency_p99_ms{};
+      double latency_max_ms{};
+      // Payload of the delivered frames over the length of the run
+      double mbytes_per_sec{};
+      ImpairmentStats link{};
+      size_t poses_sent{};
+      size_t poses_delivered{};
+      // From handing the pose to the sender to it being reassembled
+      double pose_latency_p50_ms{};
+      double pose_latency_p99_ms{};
+      double pose_latency_max_ms{};
+      // Frames which frame_latency_ms() could time, and how far off that was from the real latency
+      size_t frames_clock_timed{};
+      double clock_error_mean_ms{};
+      double clock_error_max_ms{};
+
+      std::string summary() const {
+        char s[768];
+        snprintf(s, sizeof(s), "%zu/%zu frames (%.1f%%, %zu corrupt, %zu dropped by sender), latency p50 %.2fms p95 %.2fms p99 %.2fms max %.2fms, %.1f MB/s; "
+                               "link: %llu datagrams, %llu lost, %llu burst lost, %llu queue drops, %llu duplicated, %llu reordered",
+                 frames_delivered, frames_sent, 100 * delivery_rate, frames_corrupt, frames_dropped_sender, latency_p50_ms, latency_p95_ms, latency_p99_ms, latency_max_ms, mbytes_per_sec,
+                 (unsigned long long)link.submitted, (unsigned long long)link.lost, (unsigned long long)link.lost_burst,
+                 (unsigned long long)link.dropped_queue, (unsigned long long)link.duplicated, (unsigned long long)link.reordered);
+        size_t n = strlen(s);
+        if (poses_sent) {
+          snprintf(s + n, sizeof(s) - n, "; poses: %zu/%zu, latency p50 %.2fms p99 %.2fms max %.2fms",
+                   poses_delivered, poses_sent, pose_latency_p50_ms, pose_latency_p99_ms, pose_latency_max_ms);
+          n = strlen(s);
+        }
+        if (frames_clock_timed) {
+          snprintf(s + n, sizeof(s) - n, "; synced clock: %zu frames timed, error mean %.2fms max %.2fms",
+                   frames_clock_timed, clock_error_mean_ms, clock_error_max_ms);
+        }
+        return s;
+      }
+    };
+
+    /*
+     * Serialized frames of a .vx5 voxel video (at most _max_frames), to feed bench_netstream()
+     */
+    inline std::vector<std::vector<char>> load_vx5_frames(const char* _path, size_t _max_frames = 300) {
+      std::vector<std::vector<char>> frames;
+      std::mutex frames_mutex;
+      std::atomic<bool> finished{ false };
+      Waiter waiter;
+      auto msg = std::make_unique<SerialMessage>();
+      VoxVidPlayer player([&](VoxelMessage* _v) {
+        std::lock_guard<std::mutex> lock(frames_mutex);
+        if (finished) return;
+        if (_v->pack(msg.get())) frames.emplace_back(msg->read_ptr(), msg->read_ptr() + msg->size());
+        if (frames.size() >= _max_frames) {
+          finished = true;
+          waiter.signal();
+        }
+      }, [](VoxelMessage*) {}, []() {}, [&]() {
+        finished = true;
+        waiter.signal();
+      }, [](int, int) {});
+      player.loop = false;
+      player.realtime = false;
+      if (!player.open(_path) || !player.play()) {
+        log(LogLvl::Fatal, "NB", "can't play %s", _path);
+        return {};
+      }
+      waiter.wait([&]() { return finished.load(); });
+      player.stop();
+      std::lock_guard<std::mutex> lock(frames_mutex);
+      return frames;
+    }
+
+    /*
+     * Sends _n_frames (cycling through _frames) from a MultiStream to a VNetStream over a LoopbackNet with
+     * _cfg.link impairments, and measures which frames arrive intact and how long they take, e.g.
+     *
+     *   NetBenchConfig cfg;
+     *   cfg.link.loss = 0.01;
+     *   cfg.fec_group_size = 10;
+     *   auto res = bench_netstream(load_vx5_frames("take1.vx5"), cfg);
+     *   log(LogLvl::Log, "NB", "%s", res.summary().c_str());
+     *
+     * Each frame gets an 8 byte index in front so the receiver can match it to its send time.
+     *
+     * With _cfg.pose_fps, poses go to a second peer while the frames are sent, and with _cfg.use_scheduler both
+     * share one SendScheduler, e.g. to see how long a pose waits behind the frames at a given send_rate.
+     * With _cfg.multicast_port the frames go out as LAN multicast and are received from the group instead.
+     */
+    template<class SERIAL_T = SerialMessage>
+    NetBenchResult bench_netstream(const std::vector<std::vector<char>>& _frames, const NetBenchConfig& _cfg, size_t _n_frames = 0) {
+      using clk = std::chrono::steady_clock;
+      NetBenchResult res{};
+      if (_frames.empty()) return res;
+      const size_t n_frames = _n_frames ? _n_frames : _frames.size();
+
+      static std::atomic<unsigned> run_counter{ 0 };
+      const auto run = std::to_string(run_counter++);
+      const auto tx_id = "bench-tx-" + run, rx_id = "bench-rx-" + run;
+
+      std::vector<clk::time_point> sent_at(n_frames);
+      std::vector<double> latencies_ms;
+      latencies_ms.reserve(n_frames);
+      size_t bytes_delivered = 0;
+      clk::time_point last_delivery{};
+      std::atomic<bool> receiving{ true };
+
+      RingBuffer<SERIAL_T> delivered(8);
+      std::unique_ptr<VNetStream<SERIAL_T>> rx;
+#ifdef __linux__
+      std::unique_ptr<UDPNetReceiver<SERIAL_T>> mc_rx;
+#endif
+      try {
+#ifdef __linux__
+        if (_cfg.multicast_port) mc_rx = std::make_unique<UDPNetReceiver<SERIAL_T>>(multicast_group(tx_id), _cfg.multicast_port, &delivered);
+#else
+        if (_cfg.multicast_port) throw std::exception();
+#endif
+        else rx = std::make_unique<VNetStream<SERIAL_T>>(use_loopback, _cfg.mode, rx_id.c_str(), tx_id.c_str(), _cfg.lan, &delivered);
+      } catch (std::exception&) {
+        log(LogLvl::Fatal, "NB", "can't create the receiving end of %s", tx_id.c_str());
+        return res;
+      }
+      if (rx && _cfg.clock_sync_ms) rx->enable_clock_sync(_cfg.clock_sync_ms);
+      double clock_error_sum_ms = 0;
+
+      std::vector<double> pose_latencies_ms;
+      RingBuffer<ShortSerialMessage> poses_delivered(32);
+      std::unique_ptr<VNetStream<ShortSerialMessage>> pose_rx;
+      std::thread pose_consumer;
+      if (_cfg.pose_fps > 0) {
+        pose_rx = std::make_unique<VNetStream<ShortSerialMessage>>(use_loopback, _cfg.mode, (rx_id + "-pose").c_str(), (tx_id + "-pose").c_str(), false, &poses_delivered);
+        pose_consumer = std::thread([&]() {
+          while (receiving.load(std::memory_order_relaxed)) {
+            ShortSerialMessage* m = poses_delivered.advance_tail(50);
+            if (!m) continue;
+            int64_t sent_us;
+            m->seekstart();
+            if (m->pop(sent_us)) pose_latencies_ms.push_back(1e-3 * static_cast<double>(steady_us_now() - sent_us));
+          }
+        });
+      }
+
+      std::thread consumer([&]() {
+        while (receiving.load(std::memory_order_relaxed)) {
+          SERIAL_T* m = delivered.advance_tail(50);
+          if (!m) continue;
+          uint64_t idx = UINT64_MAX;
+          m->seekstart();
+          if (m->size() < sizeof(idx) || !m->pop(idx) || idx >= n_frames) {
+            res.frames_corrupt++;
+            continue;
+          }
+          const auto& f = _frames[idx % _frames.size()];
+          bool ok = m->read_headroom() == f.size() && memcmp(m->read_ptr(), f.data(), f.size()) == 0;
+          if (ok && _cfg.decode) {
+            BufView payload(m->read_ptr(), m->read_headroom());
+            ok = _cfg.decode(&payload);
+          }
+          const auto now = clk::now();
+          if (!ok) {
+            res.frames_corrupt++;
+            continue;
+          }
+          res.frames_delivered++;
+          bytes_delivered += f.size();
+          last_delivery = now;
+          const double latency_ms = std::chrono::duration<double, std::milli>(now - sent_at[idx]).count();
+          latencies_ms.push_back(latency_ms);
+          double clock_ms;
+          if (rx && _cfg.clock_sync_ms && rx->frame_latency_ms(static_cast<int64_t>(idx), &clock_ms)) {
+            const double err = std::abs(clock_ms - latency_ms);
+            res.frames_clock_timed++;
+            clock_error_sum_ms += err;
+            res.clock_error_max_ms = std::max(res.clock_error_max_ms, err);
+          }
+        }
+      });
+
+      {
+        // Outlives the streams which use it
+        std::unique_ptr<SendScheduler> scheduler;
+        if (_cfg.use_scheduler) scheduler = std::make_unique<SendScheduler>(_cfg.send_rate);
+        MultiStream<SERIAL_T> tx_strm;
+        VNetStream<SERIAL_T>* tx = nullptr;
+        if (rx) {
+          tx = new VNetStream<SERIAL_T>(use_loopback, _cfg.mode, tx_id.c_str(), rx_id.c_str(), _cfg.lan);
+          tx->loopback()->set_impairment(_cfg.link);
+          tx_strm.add_peer(rx_id, tx);
+        }
+#ifdef __linux__
+        else tx_strm.add_multicast(tx_id, _cfg.multicast_port);
+#endif
+        if (_cfg.fec_group_size) tx_strm.set_fec_group_size(_cfg.fec_group_size);
+        if (scheduler) tx_strm.set_scheduler(scheduler.get(), SendLane::Bulk);
+        else if (_cfg.send_rate >= 0) tx_strm.set_send_rate(_cfg.send_rate);
+        tx_strm.set_admission(_cfg.admission, _cfg.max_delay_ms / 1000);
+
+        MultiStream<ShortSerialMessage> pose_strm;
+        if (pose_rx) {
+          pose_strm.add_peer(rx_id + "-pose", new VNetStream<ShortSerialMessage>(use_loopback, _cfg.mode, (tx_id + "-pose").c_str(), (rx_id + "-pose").c_str(), false));
+          if (scheduler) pose_strm.set_scheduler(scheduler.get(), SendLane::Priority);
+        }
+
+        const auto t_start = clk::now();
+        std::atomic<bool> sending{ true };
+        std::thread pose_sender;
+        if (pose_rx) {
+          pose_sender = std::thread([&]() {
+            const char pose[120]{};
+            for (size_t i = 0; sending.load(std::memory_order_relaxed); i++) {
+              precise_sleep_until(t_start + std::chrono::duration_cast<clk::duration>(std::chrono::duration<double>(i / _cfg.pose_fps)));
+              ShortSerialMessage* head = pose_strm.current_head();
+              head->reset();
+              head->put(steady_us_now());
+              head->put(pose, sizeof(pose));
+              res.poses_sent++;
+              pose_strm.try_advance_head();
+            }
+          });
+        }
+        for (size_t i = 0; i < n_frames; i++) {
+          if (_cfg.fps > 0) precise_sleep_until(t_start + std::chrono::duration_cast<clk::duration>(std::chrono::duration<double>(i / _cfg.fps)));
+          const auto& f = _frames[i % _frames.size()];
+          SERIAL_T* head = tx_strm.current_head();
+          head->reset();
+          head->put(static_cast<uint64_t>(i));
+          head->put(f.data(), f.size());
+          sent_at[i] = clk::now();
+          if (_cfg.clock_sync_ms) tx_strm.send_capture_time(static_cast<int64_t>(i), steady_us_now());
+          res.frames_sent++;
+          // Like a component, drop the frame when the sender can't keep up with the frame rate
+          if (_cfg.fps <= 0) tx_strm.advance_head();
+          else if (!tx_strm.try_advance_head()) res.frames_dropped_sender++;
+        }
+        sending = false;
+        if (pose_sender.joinable()) pose_sender.join();
+        std::this_thread::sleep_for(std::chrono::milliseconds(_cfg.drain_ms));
+        if (tx) res.frames_dropped_sender += tx->get_admission_drops() + tx->get_queue_drops();
+        for (auto&[id, udp]: tx_strm.udp_streams) res.frames_dropped_sender += udp->get_admission_drops() + udp->get_queue_drops();
+        receiving = false;
+        consumer.join();
+        if (pose_consumer.joinable()) pose_consumer.join();
+        if (tx) res.link = tx->loopback()->get_impairment_stats();
+
+        const double secs = std::chrono::duration<double>(last_delivery - t_start).count();
+        res.mbytes_per_sec = secs > 0 ? bytes_delivered / secs * 1e-6 : 0;
+      }
+      delivered.release();
+      poses_delivered.release();
+
+      res.delivery_rate = res.frames_sent ? static_cast<double>(res.frames_delivered) / res.frames_sent : 0;
+      if (!latencies_ms.empty()) {
+        std::sort(latencies_ms.begin(), latencies_ms.end());
+        const auto pct = [&](double _p) { return latencies_ms[static_cast<size_t>(_p * (latencies_ms.size() - 1))]; };
+        res.latency_p50_ms = pct(0.5);
+        res.latency_p95_ms = pct(0.95);
+        res.latency_p99_ms = pct(0.99);
+        res.latency_max_ms = latencies_ms.back();
+      }
+      if (res.frames_clock_timed) res.clock_error_mean_ms = clock_error_sum_ms / res.frames_clock_timed;
+      res.poses_delivered = pose_latencies_ms.size();
+      if (!pose_latencies_ms.empty()) {
+        std::sort(pose_latencies_ms.begin(), pose_latencies_ms.end());
+        res.pose_latency_p50_ms = pose_latencies_ms[(pose_latencies_ms.size() - 1) / 2];
+        res.pose_latency_p99_ms = pose_latencies_ms[static_cast<size_t>(0.99 * (pose_latencies_ms.size() - 1))];
+        res.pose_latency_max_ms = pose_latencies_ms.back();
+      }
+      return res;
+    }
+  }
+}
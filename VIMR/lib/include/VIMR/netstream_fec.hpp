@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+namespace VIMR
+{
+  namespace Network
+  {
+    /*
+     * XOR parity for message fragments.
+     *
+     * The data fragments of a message are split into groups of group_size consecutive fragments (the last group
+     * may be shorter). After each group the sender adds one parity fragment which is the XOR of the group's
+     * payloads, so the receiver can rebuild any single lost fragment per group. Overhead is 1/group_size,
+     * e.g. group_size 10 costs 10% more bandwidth.
+     *
+     * A parity fragment has frag_number = parity_flag | group index, and its payload is
+     *   [uint16 group_size][uint16 fragments in this group][uint16 XOR of their lengths][XOR of their payloads]
+     * where the XOR is as long as the longest payload in the group (shorter ones are zero-padded).
+     */
+    namespace Fec
+    {
+      static constexpr uint16_t parity_flag = 0x8000;
+      static constexpr size_t parity_header_size = 3 * sizeof(uint16_t);
+      // Parity has to fit in the fragment counter, so FEC can't be used with more data fragments than this
+      static constexpr size_t max_data_frags = parity_flag;
+
+      inline void xor_into(char* _dst, const char* _src, size_t _n)
+      {
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= _n; i += sizeof(uint64_t))
+        {
+          uint64_t a, b;
+          memcpy(&a, _dst + i, sizeof(a));
+          memcpy(&b, _src + i, sizeof(b));
+          a ^= b;
+          memcpy(_dst + i, &a, sizeof(a));
+        }
+        for (; i < _n; i++) _dst[i] ^= _src[i];
+      }
+    }
+
+    /*
+     * Accumulates the parity of one group on the sending side
+     */
+    struct FecEncoder
+    {
+      std::vector<char> parity;
+      size_t parity_len = 0;
+      uint16_t len_xor = 0;
+      uint16_t n_frags = 0;
+
+      void add(const char* _d, size_t _n)
+      {
+        if (parity.size() < _n) parity.resize(_n, 0);
+        Fec::xor_into(parity.data(), _d, _n);
+        parity_len = std::max(parity_len, _n);
+        len_xor ^= static_cast<uint16_t>(_n);
+        n_frags++;
+      }
+      void reset()
+      {
+        std::fill(parity.begin(), parity.begin() + static_cast<long>(parity_len), 0);
+        parity_len = 0;
+        len_xor = 0;
+        n_frags = 0;
+      }
+    };
+  }
+}
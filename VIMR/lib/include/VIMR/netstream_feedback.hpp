@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+
+namespace VIMR
+{
+  namespace Network
+  {
+    /*
+     * Control datagrams travel on the same link as message fragments, but with frag_count == 0 (which no message
+     * has). Their payload is [uint16 type][type specific data]. Assemblers hand them to their control handler
+     * instead of reassembling them, even when they have no message consumer.
+     */
+    namespace Control
+    {
+      // ClockProbe, answered with a ClockReply (see ClockSync)
+      static constexpr uint16_t clock_probe = 2;
+      static constexpr uint16_t clock_reply = 3;
+      // FrameTime, see VNetStream::send_capture_time()
+      static constexpr uint16_t frame_time = 4;
+    }
+
+    /*
+     * Times are steady_us_now() of whoever took them
+     */
+    struct ClockProbe {
+      int64_t t_sent_us{};
+    };
+    struct ClockReply {
+      // ClockProbe::t_sent_us, echoed back
+      int64_t t_probe_us{};
+      int64_t t_received_us{};
+      int64_t t_sent_us{};
+    };
+    /*
+     * When a frame was captured (steady_us_now() of the sender). Sent next to the frame instead of in it, so that the
+     * message format, which the prebuilt library encodes, doesn't change.
+     */
+    struct FrameTime {
+      int64_t frame_number{};
+      int64_t capture_time_us{};
+    };
+  }
+}
@@ -5,6 +5,15 @@
 #include "vnet.hpp"
 #include "serialbuffer.hpp"
 #include "freq_estimation.hpp"
+#include "pacer.hpp"
+#include "netstream_fec.hpp"
+#include "netstream_feedback.hpp"
+#include <map>
+#include <memory>
+#include <chrono>
+#include <cstring>
+#include <iterator>
+#include <vector>
 #include <utility>
 #include <algorithm>
 
@@ -44,94 +53,734 @@ namespace VIMR
         return true;
       }
     };
+    /*
+     * Header and payload of a received datagram, parsed in place
+     */
+    struct FragmentView {
+      unsigned long long message_id{};
+      uint16_t frag_number{};
+      uint16_t frag_count{};
+      const char* data{};
+      size_t size{};
+      bool parse(const char* _d, size_t _n) {
+        if (_n < MessageFragment::frag_header_size) return false;
+        memcpy(&message_id, _d, sizeof(message_id));
+        memcpy(&frag_number, _d + sizeof(message_id), sizeof(frag_number));
+        memcpy(&frag_count, _d + sizeof(message_id) + sizeof(frag_number), sizeof(frag_count));
+        data = _d + MessageFragment::frag_header_size;
+        size = _n - MessageFragment::frag_header_size;
+        return true;
+      }
+      bool is_parity() const {
+        return (frag_number & Fec::parity_flag) != 0;
+      }
+      uint16_t parity_group() const {
+        return frag_number & ~Fec::parity_flag;
+      }
+    };
+    /*
+     * Rebuilds messages from their fragments.
+     *
+     * receive() is called straight from the transport's receive thread and writes each fragment's payload at
+     * frag_number * fragment size in a message buffer of its own, so every byte is copied once between the socket
+     * and the consumer. A completed buffer is swapped into the head of the message consumer.
+     *
+     * Up to max_in_flight messages are assembled at the same time, and fragments may arrive in any order (a bitmap
+     * tracks which ones are there). Messages are delivered in the order in which they complete. An incomplete
+     * message is dropped once nothing has arrived for it for timeout_ms, or when the window is full and a newer
+     * message starts.
+     *
+     * With FEC (see netstream_fec.hpp) a group which is missing exactly one fragment is rebuilt from its parity.
+     */
     template<class SERIAL_T>
-    struct MessageAssembler : public BufferProcessor<MessageFragment> {
-      uint16_t expected_frag_number{};
-      unsigned long long expected_message_id{};
-      MessageAssembler(string& _peer_id, RingBuffer<SERIAL_T>* _message_consumer) : BufferProcessor<MessageFragment>(128, [this, _message_consumer, &_peer_id](MessageFragment* _fragment) {
-        if (!_message_consumer) {
-          log(LogLvl::Fatal, "NS", "%s Received message but no message consumer exists. Ignoring.", _peer_id.c_str());
-          return;
+    struct MessageAssembler {
+      static constexpr size_t max_in_flight = 4;
+      unsigned long timeout_ms = 500;
+      // Fragments which were rebuilt from parity / messages which were dropped incomplete
+      std::atomic<uint64_t> n_fec_recovered{ 0 };
+      std::atomic<uint64_t> n_dropped{ 0 };
+
+      using ControlHandler = std::function<void(uint16_t _type, const char* _d, size_t _n)>;
+
+      MessageAssembler(const string& _peer_id, RingBuffer<SERIAL_T>* _message_consumer) : peer_id(_peer_id), message_consumer(_message_consumer) {}
+      MessageAssembler(const MessageAssembler&) = delete;
+
+      /*
+       * Called (from the receive thread) for every control datagram, see netstream_feedback.hpp.
+       * May be called while datagrams are arriving, but only once.
+       */
+      void set_control_handler(ControlHandler _handler) {
+        control_handler = std::move(_handler);
+        has_control_handler.store(true, std::memory_order_release);
+      }
+
+      /*
+       * Handles one datagram. Must always be called from the same thread.
+       * Returns false if the message consumer (or this) has been released.
+       */
+      bool receive(const char* _d, size_t _n) {
+        if (is_released.load(std::memory_order_relaxed)) return false;
+        FragmentView frag;
+        if (!frag.parse(_d, _n)) return true;
+        if (frag.frag_count == 0) {
+          uint16_t type;
+          if (frag.size >= sizeof(type) && has_control_handler.load(std::memory_order_acquire)) {
+            memcpy(&type, frag.data, sizeof(type));
+            control_handler(type, frag.data + sizeof(type), frag.size - sizeof(type));
+          }
+          return true;
+        }
+        if (!message_consumer) {
+          log(LogLvl::Fatal, "NS", "%s Received message but no message consumer exists. Ignoring.", peer_id.c_str());
+          return true;
         }
-        if(_message_consumer->released()){
+        if(message_consumer->released()){
           release();
-          return;
+          return false;
         }
 
-        auto current_tgt_buffer = _message_consumer->current_head();
-        if(_fragment->is_first())
-        {
-          if(expected_frag_number != 0) log(LogLvl::Warn, "NS", "%s  Frag 0 received, but expected %i/%i", _peer_id.c_str(), expected_frag_number, _fragment->frag_count);
-          current_tgt_buffer->reset();
-          expected_message_id = _fragment->message_id;
-          expected_frag_number = 0;
+        const auto now = std::chrono::steady_clock::now();
+        drop_stale(now);
+        // Late fragments (e.g. the last parity) of a message which was already delivered or dropped
+        if (is_finished(frag.message_id)) return true;
+
+        InFlight* msg = find_or_start(frag);
+        if (!msg) return true;
+        msg->last_activity = now;
+        if (frag.is_parity()) add_parity(*msg, frag);
+        else place(*msg, frag.frag_number, frag.data, frag.size);
+
+        if (msg->complete()) deliver(*msg);
+        return true;
+      }
+      void release() {
+        is_released.store(true);
+      }
+      bool released() const {
+        return is_released.load();
+      }
+
+     private:
+      struct Parity {
+        uint16_t group_frags{};
+        uint16_t len_xor{};
+        std::vector<char> data;
+      };
+      struct InFlight {
+        bool active = false;
+        unsigned long long message_id{};
+        uint16_t frag_count{};
+        uint16_t n_received{};
+        // Payload size of every fragment except the last, 0 until the first one arrives
+        size_t full_size{};
+        size_t last_size{};
+        std::vector<uint64_t> received;
+        // Swapped with the consumer's head when complete, so it is whichever buffer the consumer last gave back
+        std::unique_ptr<SERIAL_T> buffer;
+        // The last fragment can't be placed before full_size is known
+        std::vector<char> pending_last;
+        bool has_pending_last = false;
+        uint16_t group_size{};
+        std::map<uint16_t, Parity> parity;
+        std::chrono::steady_clock::time_point last_activity;
+
+        bool has(size_t _i) const {
+          return (received[_i >> 6] >> (_i & 63)) & 1;
+        }
+        void mark(size_t _i) {
+          received[_i >> 6] |= uint64_t(1) << (_i & 63);
+        }
+        bool complete() const {
+          return active && n_received == frag_count;
         }
-        else if(expected_message_id != _fragment->message_id)
-        {
-          log(LogLvl::Warn, "NS", "%s Unexpected message ID %i", _peer_id.c_str(), _fragment->message_id);
-          current_tgt_buffer->reset();
-          expected_frag_number = 0;
+        const char* fragment(size_t _i) const {
+          return buffer->read_ptr() + _i * full_size;
+        }
+      };
+      const string peer_id;
+      RingBuffer<SERIAL_T>* message_consumer;
+      std::atomic<bool> is_released{ false };
+      InFlight in_flight[max_in_flight];
+      unsigned long long finished_ids[32]{};
+      size_t n_finished = 0;
+      std::vector<char> recovered;
+      ControlHandler control_handler;
+      std::atomic<bool> has_control_handler{ false };
+
+      bool is_finished(unsigned long long _id) const {
+        for (const auto f: finished_ids) if (f == _id) return true;
+        return false;
+      }
+      void finish(InFlight& _m) {
+        finished_ids[n_finished++ % std::size(finished_ids)] = _m.message_id;
+        _m.active = false;
+        _m.parity.clear();
+      }
+      void drop(InFlight& _m, const char* _reason) {
+        log(LogLvl::Warn, "NS", "%s Dropping message %llu (%s), got %i/%i fragments", peer_id.c_str(), _m.message_id, _reason, _m.n_received, _m.frag_count);
+        n_dropped.fetch_add(1, std::memory_order_relaxed);
+        finish(_m);
+      }
+      void drop_stale(std::chrono::steady_clock::time_point _now) {
+        for (auto& m: in_flight) {
+          if (m.active && _now - m.last_activity > std::chrono::milliseconds(timeout_ms)) drop(m, "timed out");
+        }
+      }
+      InFlight* find_or_start(const FragmentView& _frag) {
+        InFlight* slot = nullptr;
+        InFlight* oldest = nullptr;
+        for (auto& m: in_flight) {
+          if (m.active && m.message_id == _frag.message_id) return &m;
+          if (!m.active) slot = &m;
+          else if (!oldest || m.message_id < oldest->message_id) oldest = &m;
+        }
+        if (_frag.frag_count == 0) return nullptr;
+        if (!slot) {
+          // Window is full: a message older than all of the in-flight ones is stale, otherwise make room
+          if (_frag.message_id < oldest->message_id) return nullptr;
+          drop(*oldest, "window full");
+          slot = oldest;
+        }
+        if (!slot->buffer) slot->buffer = std::make_unique<SERIAL_T>();
+        slot->buffer->reset();
+        slot->active = true;
+        slot->message_id = _frag.message_id;
+        slot->frag_count = _frag.frag_count;
+        slot->n_received = 0;
+        slot->full_size = 0;
+        slot->last_size = 0;
+        slot->has_pending_last = false;
+        slot->group_size = 0;
+        slot->received.assign((slot->frag_count + 63) / 64, 0);
+        return slot;
+      }
+      void set_full_size(InFlight& _m, size_t _n) {
+        _m.full_size = _n;
+        if (_m.has_pending_last) {
+          _m.has_pending_last = false;
+          place(_m, _m.frag_count - 1u, _m.pending_last.data(), _m.pending_last.size());
+        }
+      }
+      void place(InFlight& _m, size_t _i, const char* _d, size_t _n) {
+        if (_i >= _m.frag_count || _m.has(_i)) return;
+        const bool is_last = _i + 1 == _m.frag_count;
+        if (!is_last) {
+          if (!_m.full_size) set_full_size(_m, _n);
+          else if (_n != _m.full_size) {
+            log(LogLvl::Warn, "NS", "%s Fragment %i/%i has size %zu, expected %zu", peer_id.c_str(), static_cast<int>(_i), _m.frag_count, _n, _m.full_size);
+            return;
+          }
+        }
+        else if (!_m.full_size && _m.frag_count > 1) {
+          _m.pending_last.assign(_d, _d + _n);
+          _m.has_pending_last = true;
           return;
         }
-        else if(_fragment->frag_number != expected_frag_number)
-        {
-          log(LogLvl::Warn, "NS", "%s Out of sequence fragment. Expected %i, got %i", _peer_id.c_str(), expected_frag_number, _fragment->frag_number);
-          current_tgt_buffer->reset();
-          expected_frag_number = 0;
+        else {
+          _m.last_size = _n;
+        }
+        if (!_m.buffer->put_at(_i * _m.full_size, _d, _n)) {
+          drop(_m, "too large for the message buffer");
           return;
         }
-
-        if (!current_tgt_buffer->put(*static_cast<BufReader*>(&_fragment->payload), _fragment->payload.read_headroom())) {
-          log(LogLvl::Warn, "NS", "%s Failed to unpack fragment %i/%i", _peer_id.c_str(), _fragment->frag_number, _fragment->frag_count);
+        _m.mark(_i);
+        _m.n_received++;
+        if (_m.group_size) try_recover(_m, static_cast<uint16_t>(_i / _m.group_size));
+      }
+      void add_parity(InFlight& _m, const FragmentView& _frag) {
+        if (_frag.size < Fec::parity_header_size) return;
+        uint16_t hdr[3];
+        memcpy(hdr, _frag.data, sizeof(hdr));
+        const uint16_t group_size = hdr[0], group_frags = hdr[1], len_xor = hdr[2];
+        if (group_size == 0) return;
+        _m.group_size = group_size;
+        auto& par = _m.parity[_frag.parity_group()];
+        par.group_frags = group_frags;
+        par.len_xor = len_xor;
+        par.data.assign(_frag.data + Fec::parity_header_size, _frag.data + _frag.size);
+        // A group with two or more fragments has a full size one in it, so the parity is full size too
+        if (!_m.full_size && group_frags >= 2) set_full_size(_m, par.data.size());
+        if (_m.active) try_recover(_m, _frag.parity_group());
+      }
+      /*
+       * Rebuilds the missing fragment of group _g if there is exactly one and the parity for the group has arrived
+       */
+      void try_recover(InFlight& _m, uint16_t _g) {
+        auto it = _m.parity.find(_g);
+        if (it == _m.parity.end()) return;
+        const size_t first = static_cast<size_t>(_g) * _m.group_size;
+        const size_t end = std::min<size_t>(first + it->second.group_frags, _m.frag_count);
+        size_t missing = end;
+        for (size_t i = first; i < end; i++) {
+          if (_m.has(i)) continue;
+          if (missing != end) return;
+          missing = i;
+        }
+        if (missing == end || (!_m.full_size && _m.frag_count > 1)) {
+          if (missing == end) _m.parity.erase(it);
           return;
         }
-
-        if(_fragment->is_last())
-        {
-          if (!_message_consumer->try_advance_head()) log(LogLvl::Warn, "NS", "%s Message receive buffer is full. Re-using current one.", _peer_id.c_str());
-          expected_frag_number = 0;
+        recovered.swap(it->second.data);
+        uint16_t len = it->second.len_xor;
+        _m.parity.erase(it);
+        for (size_t i = first; i < end; i++) {
+          if (i == missing) continue;
+          const size_t n = (i + 1 == _m.frag_count) ? _m.last_size : _m.full_size;
+          if (n > recovered.size()) return;
+          Fec::xor_into(recovered.data(), _m.fragment(i), n);
+          len ^= static_cast<uint16_t>(n);
         }
-        else
-        {
-          expected_frag_number = (expected_frag_number + 1) % _fragment->frag_count;
+        if (len > recovered.size()) return;
+        n_fec_recovered.fetch_add(1, std::memory_order_relaxed);
+        place(_m, missing, recovered.data(), len);
+      }
+      void deliver(InFlight& _m) {
+        _m.buffer->swap(*message_consumer->current_head());
+        if (!message_consumer->try_advance_head()) {
+          log(LogLvl::Warn, "NS", "%s Message receive buffer is full. Re-using current one.", peer_id.c_str());
+        }
+        finish(_m);
+      }
+    };
+    /*
+     * Message ids have to be unique per sender, the assembler ignores late fragments of messages it has finished.
+     * They start from the wall clock (not the steady clock) so that they keep increasing when the sender restarts.
+     * They are not timestamps: within a millisecond they count up.
+     */
+    inline unsigned long long next_message_id() {
+      static std::atomic<unsigned long long> last_id{ 0 };
+      unsigned long long prev = last_id.load(std::memory_order_relaxed);
+      unsigned long long id;
+      do {
+        id = std::max<unsigned long long>(ms_now, prev + 1);
+      } while (!last_id.compare_exchange_weak(prev, id, std::memory_order_relaxed));
+      return id;
+    }
+
+    /*
+     * All datagrams of one message (data fragments, with a parity fragment after every FEC group), each stored at
+     * i * frag_size. Built once and then only read, so every MessageFragmenter the message goes to can share it.
+     */
+    struct FragmentSet {
+      unsigned long long message_id{};
+      size_t frag_size{};
+      size_t fec_group_size{};
+      std::vector<char> data;
+      std::vector<size_t> sizes;
+      // All datagrams together
+      size_t total_bytes{};
+      bool is_control = false;
+
+      size_t num_fragments() const {
+        return sizes.size();
+      }
+      const char* fragment(size_t _i) const {
+        return data.data() + _i * frag_size;
+      }
+      /*
+       * Fragments _src into datagrams of at most _frag_payload_size bytes. Doesn't move _src's read position.
+       */
+      bool build(const BufReader* _src, size_t _frag_payload_size, size_t _fec_group_size) {
+        const size_t header_size = MessageFragment::frag_header_size + (_fec_group_size ? Fec::parity_header_size : 0);
+        if (_frag_payload_size <= header_size) return false;
+        // With FEC the data payload is a little smaller, so parity fragments (which have an extra header) fit as well
+        const size_t max_payload_size = _frag_payload_size - header_size;
+        const size_t n_bytes = _src->size();
+        sizes.clear();
+        total_bytes = 0;
+        if (!n_bytes) return true;
+        const size_t n_data = std::max<size_t>(1, (n_bytes / max_payload_size) + !!(n_bytes % max_payload_size));
+        if (n_data > UINT16_MAX || (_fec_group_size && n_data > Fec::max_data_frags)) return false;
+        const auto frag_count = static_cast<uint16_t>(n_data);
+        const auto group_size = static_cast<uint16_t>(std::min<size_t>(_fec_group_size, UINT16_MAX));
+        const size_t n_parity = group_size ? (n_data + group_size - 1) / group_size : 0;
+
+        message_id = next_message_id();
+        frag_size = _frag_payload_size;
+        fec_group_size = group_size;
+        is_control = false;
+        if (data.size() < (n_data + n_parity) * frag_size) data.resize((n_data + n_parity) * frag_size);
+        FecEncoder fec;
+        const char* src = _src->read_ptr() - (_src->size() - _src->read_headroom());
+        size_t offset = 0;
+        for (uint16_t frag_number = 0; frag_number < frag_count; frag_number++) {
+          const size_t n = std::min(n_bytes - offset, max_payload_size);
+          char* d = put_header(frag_number, frag_count);
+          memcpy(d + MessageFragment::frag_header_size, src + offset, n);
+          sizes.push_back(MessageFragment::frag_header_size + n);
+          offset += n;
+          if (!group_size) continue;
+          fec.add(src + offset - n, n);
+          if ((frag_number + 1) % group_size == 0 || frag_number + 1 == frag_count) {
+            d = put_header(static_cast<uint16_t>(Fec::parity_flag | (frag_number / group_size)), frag_count);
+            d += MessageFragment::frag_header_size;
+            const uint16_t parity_header[3] = { group_size, fec.n_frags, fec.len_xor };
+            memcpy(d, parity_header, sizeof(parity_header));
+            memcpy(d + sizeof(parity_header), fec.parity.data(), fec.parity_len);
+            sizes.push_back(MessageFragment::frag_header_size + sizeof(parity_header) + fec.parity_len);
+            fec.reset();
+          }
         }
-      }) {}
+        total_bytes = 0;
+        for (const auto n: sizes) total_bytes += n;
+        return true;
+      }
+      /*
+       * A single control datagram (see netstream_feedback.hpp)
+       */
+      void build_control(uint16_t _type, const void* _d, size_t _n) {
+        message_id = next_message_id();
+        frag_size = MessageFragment::frag_header_size + sizeof(_type) + _n;
+        fec_group_size = 0;
+        if (data.size() < frag_size) data.resize(frag_size);
+        sizes.clear();
+        char* d = put_header(0, 0) + MessageFragment::frag_header_size;
+        memcpy(d, &_type, sizeof(_type));
+        memcpy(d + sizeof(_type), _d, _n);
+        sizes.push_back(frag_size);
+        total_bytes = frag_size;
+        is_control = true;
+      }
+     private:
+      char* put_header(uint16_t _frag_number, uint16_t _frag_count) {
+        char* d = data.data() + sizes.size() * frag_size;
+        memcpy(d, &message_id, sizeof(message_id));
+        memcpy(d + sizeof(message_id), &_frag_number, sizeof(_frag_number));
+        memcpy(d + sizeof(message_id) + sizeof(_frag_number), &_frag_count, sizeof(_frag_count));
+        return d;
+      }
     };
-    struct MessageFragmenter : public BufferProcessor<MessageFragment> {
-      MessageFragmenter(const std::function<bool(BufReader*)>& _send_fn) : BufferProcessor<MessageFragment>(128, [_send_fn](MessageFragment* _frag) {
-        if(!_send_fn(&_frag->payload))
-        {
-          // FIXME What do if fails?
-        };
-        //FIXME: VNet should block if the send buffer is full (but that has to happen inrust)
-        // This time-delay hack works for now
-        std::this_thread::sleep_for(std::chrono::microseconds(700));
-      }) {
-      }
-      bool send(string& _peer_id, BufReader* _src, size_t frag_payload_size) {
-        auto max_payload_size = frag_payload_size - MessageFragment::frag_header_size;
-        _src->seekstart();
-        auto frag_count = static_cast<uint16_t>((_src->read_headroom() / max_payload_size) + !!(_src->read_headroom() % max_payload_size));
-        uint16_t frag_number = 0;
-        unsigned long long current_message_id = ms_now;
-        while (_src->read_headroom() > 0) {
-          auto* current_fragment = current_head();
-          current_fragment->message_id = current_message_id;
-          current_fragment->frag_number = frag_number;
-          current_fragment->frag_count = frag_count;
-          if (!current_fragment->pack_payload(_src, max_payload_size)) {
-            log(LogLvl::Fatal, "NS", "%s copying to fragment buffer failed. Something is messed up bad.", _peer_id.c_str());
-            return false;
+    using FragmentSetPtr = std::shared_ptr<const FragmentSet>;
+
+    /*
+     * Hands out FragmentSets which nothing references any more, so that sending doesn't allocate once it has warmed up.
+     * Not thread safe, use one per sending thread.
+     */
+    class FragmentSetPool {
+      static constexpr size_t max_pooled = 8;
+      std::vector<std::shared_ptr<FragmentSet>> sets;
+     public:
+      std::shared_ptr<FragmentSet> get() {
+        for (auto& s: sets) {
+          if (s.use_count() == 1) {
+            // Pairs with the release in the last other owner's reference drop
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return s;
           }
-          frag_number++;
+        }
+        auto s = std::make_shared<FragmentSet>();
+        if (sets.size() < max_pooled) sets.push_back(s);
+        return s;
+      }
+    };
+
+    class SendScheduler;
+    struct SendFlow;
+    enum class SendLane : uint8_t;
 
-          if (!try_advance_head()) {
-            log(LogLvl::Warn, "NS", "%s frag send_to_peer buffer full, dropping message at fragment %i of %i", _peer_id.c_str(), frag_number, frag_count);
-            return false;
+    /*
+     * What a sender does with a message that can't go out before the next one is due (see
+     * MessageFragmenter::set_admission()). A message is only ever dropped whole, never after its first fragment.
+     */
+    enum class Admission : uint8_t {
+      // Queue everything, only drop when the queue is full
+      QueueAll,
+      // Drop the new message
+      DropNew,
+      // Drop the queued messages that haven't started sending, so the new one goes out next
+      ReplaceQueued
+    };
+
+    /*
+     * Sends the fragments of queued FragmentSets from its own thread, paced by a token bucket so a whole message goes
+     * out at the configured link rate instead of all at once (VNet drops datagrams when its send buffer is full).
+     * Not on an Executor because pacing sleeps between fragments, which would hold up a shared worker.
+     *
+     * Until set_send_rate() is called the rate defaults to one full fragment per 700us, which is what the fixed
+     * sleep this replaced amounted to.
+     *
+     * After use_scheduler() messages go to a shared SendScheduler instead, which sends and paces them together
+     * with other streams' (see netstream_scheduler.hpp).
+     */
+    struct MessageFragmenter : public BufferProcessor<FragmentSetPtr> {
+      static constexpr double legacy_frag_interval_s = 700e-6;
+      static constexpr double default_burst_frags = 4;
+      // Messages, not fragments
+      static constexpr size_t queue_size = 8;
+
+      MessageFragmenter(const std::function<bool(BufReader*)>& _send_fn, const char* _stats_name = nullptr) : BufferProcessor<FragmentSetPtr>(queue_size, [this, _send_fn](FragmentSetPtr* _set) {
+        const FragmentSet& set = **_set;
+        if (replaced(set)) {
+          _set->reset();
+          return;
+        }
+        BufView view;
+        size_t failed_group = no_group;
+        for (size_t i = 0; i < set.num_fragments(); i++) {
+          view.reset(set.fragment(i), set.sizes[i]);
+          pacer.pace(set.sizes[i]);
+          const bool sent = _send_fn(&view);
+          queued_bytes.fetch_sub(set.sizes[i], std::memory_order_relaxed);
+          if (!sent && !on_send_failed(set, i, failed_group)) {
+            drop_rest(set, i + 1);
+            break;
           }
         }
+        _set->reset();
+      }, _stats_name), single_send(_send_fn), name(_stats_name ? _stats_name : "fragmenter") {
+      }
+      /*
+       * For transports that can send several datagrams per call. _send_batch_fn gets runs of up to
+       * max_send_batch consecutive fragments and returns how many it sent; each run is paced as a whole.
+       */
+      static constexpr size_t max_send_batch = 16;
+      using BatchSendFunction = std::function<size_t(BufReader* const*, size_t)>;
+      MessageFragmenter(const BatchSendFunction& _send_batch_fn, const char* _stats_name = nullptr) : BufferProcessor<FragmentSetPtr>(queue_size, [this, _send_batch_fn](FragmentSetPtr* _set) {
+        const FragmentSet& set = **_set;
+        if (replaced(set)) {
+          _set->reset();
+          return;
+        }
+        BufView views[max_send_batch];
+        BufReader* bufs[max_send_batch];
+        size_t failed_group = no_group;
+        for (size_t i = 0; i < set.num_fragments(); i += max_send_batch) {
+          const size_t k = std::min(max_send_batch, set.num_fragments() - i);
+          size_t n_bytes = 0;
+          for (size_t j = 0; j < k; j++) {
+            views[j].reset(set.fragment(i + j), set.sizes[i + j]);
+            bufs[j] = &views[j];
+            n_bytes += set.sizes[i + j];
+          }
+          pacer.pace(n_bytes);
+          const size_t n_sent = _send_batch_fn(bufs, k);
+          queued_bytes.fetch_sub(n_bytes, std::memory_order_relaxed);
+          // The fragments after the first failed one weren't sent either
+          bool keep_sending = true;
+          for (size_t j = n_sent; j < k && keep_sending; j++) keep_sending = on_send_failed(set, i + j, failed_group);
+          if (!keep_sending) {
+            drop_rest(set, i + k);
+            break;
+          }
+        }
+        _set->reset();
+      }, _stats_name), single_send([_send_batch_fn](BufReader* _b) {
+        return _send_batch_fn(&_b, 1) == 1;
+      }), name(_stats_name ? _stats_name : "fragmenter") {
+      }
+      ~MessageFragmenter();
+      /*
+       * Hand messages to _scheduler from now on, as flow _flow_id in _lane (see SendScheduler). Call before the
+       * first send(). The fragmenter's own rate no longer applies, the scheduler's does.
+       */
+      void use_scheduler(SendScheduler* _scheduler, SendLane _lane, const string& _flow_id, unsigned _weight = 1);
+      /*
+       * Share of the scheduler's bulk lane relative to other flows (default 1)
+       */
+      void set_weight(unsigned _weight);
+      /*
+       * Bytes per second on the wire (fragment headers included), 0 = unpaced, < 0 = back to the default rate.
+       * _burst_bytes is how much may go out back-to-back after an idle period, <= 0 uses default_burst_frags
+       * fragments of the send() size (updated by send() whenever that changes, including before the first send()).
+       */
+      void set_send_rate(double _bytes_per_sec, double _burst_bytes = 0) {
+        const auto frag_size = static_cast<double>(last_frag_size.load(std::memory_order_relaxed));
+        burst_set.store(_burst_bytes > 0, std::memory_order_relaxed);
+        if (_burst_bytes <= 0) _burst_bytes = default_burst_frags * frag_size;
+        rate_set.store(_bytes_per_sec >= 0, std::memory_order_relaxed);
+        if (_bytes_per_sec < 0) _bytes_per_sec = frag_size / legacy_frag_interval_s;
+        pacer.set_rate(_bytes_per_sec, _burst_bytes);
+      }
+      double get_send_rate() const {
+        return pacer.get_rate();
+      }
+      double get_send_burst() const {
+        return pacer.get_burst();
+      }
+      /*
+       * Adds one XOR parity fragment per _group_size data fragments (see netstream_fec.hpp), 0 turns FEC off.
+       * Takes effect from the next message.
+       */
+      void set_fec_group_size(size_t _group_size) {
+        fec_group_size.store(std::min<size_t>(_group_size, UINT16_MAX), std::memory_order_relaxed);
+      }
+      size_t get_fec_group_size() const {
+        return fec_group_size.load(std::memory_order_relaxed);
+      }
+      /*
+       * Admission control for send(): a message is late if the bytes queued ahead of it (plus its own) take longer
+       * than _max_delay_s to go out at the send rate. _max_delay_s <= 0 uses the measured interval between
+       * messages, i.e. a message is late if it would still be sending when the next one is due.
+       * Control datagrams are always queued.
+       */
+      void set_admission(Admission _policy, double _max_delay_s = 0) {
+        max_delay_s.store(_max_delay_s, std::memory_order_relaxed);
+        admission.store(_policy, std::memory_order_relaxed);
+      }
+      /*
+       * Messages dropped or replaced by admission control
+       */
+      uint64_t get_admission_drops() const {
+        return n_admission_drops.load(std::memory_order_relaxed);
+      }
+      /*
+       * Messages dropped because the send queue was full
+       */
+      uint64_t get_queue_drops() const {
+        return n_queue_drops.load(std::memory_order_relaxed);
+      }
+      /*
+       * Datagrams the transport failed to send, and messages whose remaining fragments were dropped because of that.
+       * With a SendScheduler failures are only counted, the scheduler sends every fragment.
+       */
+      uint64_t get_send_failures() const {
+        return n_send_failures.load(std::memory_order_relaxed);
+      }
+      uint64_t get_send_failure_drops() const {
+        return n_send_failure_drops.load(std::memory_order_relaxed);
+      }
+      /*
+       * Fragments _src and queues it. Must only be called from one thread at a time.
+       */
+      bool send(const string& _peer_id, BufReader* _src, size_t frag_payload_size) {
+        auto set = pool.get();
+        if (!set->build(_src, frag_payload_size, fec_group_size.load(std::memory_order_relaxed))) {
+          log(LogLvl::Fatal, "NS", "%s message of %zu bytes can't be fragmented into %zu byte datagrams", _peer_id.c_str(), _src->size(), frag_payload_size);
+          return false;
+        }
+        return send(_peer_id, std::move(set));
+      }
+      /*
+       * Queues a control datagram (see netstream_feedback.hpp). Same threading rules as send().
+       */
+      bool send_control(const string& _peer_id, uint16_t _type, const void* _d, size_t _n) {
+        auto set = pool.get();
+        set->build_control(_type, _d, _n);
+        return enqueue(_peer_id, std::move(set));
+      }
+      /*
+       * Queues an already fragmented message, which may be shared with other fragmenters
+       */
+      bool send(const string& _peer_id, FragmentSetPtr _set) {
+        if (_set->num_fragments() == 0) return true;
+        const size_t frag_payload_size = _set->frag_size;
+        if (last_frag_size.exchange(frag_payload_size, std::memory_order_relaxed) != frag_payload_size) {
+          const double burst = default_burst_frags * static_cast<double>(frag_payload_size);
+          if (!rate_set.load(std::memory_order_relaxed)) pacer.set_rate(static_cast<double>(frag_payload_size) / legacy_frag_interval_s, burst);
+          else if (!burst_set.load(std::memory_order_relaxed)) pacer.set_rate(pacer.get_rate(), burst);
+        }
+        const auto now = std::chrono::steady_clock::now();
+        if (last_send != std::chrono::steady_clock::time_point{}) {
+          const double dt = std::chrono::duration<double>(now - last_send).count();
+          send_interval_s = send_interval_s > 0 ? 0.9 * send_interval_s + 0.1 * dt : dt;
+        }
+        last_send = now;
+        if (!flow && !admit(_peer_id, *_set)) return false;
+        return enqueue(_peer_id, std::move(_set));
+      }
+     private:
+      double delay_budget() const {
+        const double d = max_delay_s.load(std::memory_order_relaxed);
+        return d > 0 ? d : send_interval_s;
+      }
+      bool admit(const string& _peer_id, const FragmentSet& _set) {
+        const auto policy = admission.load(std::memory_order_relaxed);
+        const double rate = pacer.get_rate();
+        const double budget = delay_budget();
+        const size_t queued = queued_bytes.load(std::memory_order_relaxed);
+        // A message with nothing ahead of it is always sent, even if it alone takes longer than the budget
+        if (policy == Admission::QueueAll || rate <= 0 || budget <= 0 || queued == 0) return true;
+        const double drain_s = static_cast<double>(queued + _set.total_bytes) / rate;
+        if (drain_s <= budget) return true;
+        if (policy == Admission::DropNew) {
+          n_admission_drops.fetch_add(1, std::memory_order_relaxed);
+          log(LogLvl::LogLow, "NS", "%s link behind (%.1fms queued), dropping message %llu", _peer_id.c_str(), 1e3 * drain_s, _set.message_id);
+          return false;
+        }
+        // Everything queued that hasn't started is skipped by the sending thread
+        log(LogLvl::LogLow, "NS", "%s link behind (%.1fms queued), replacing queued messages with %llu", _peer_id.c_str(), 1e3 * drain_s, _set.message_id);
+        replace_before.store(_set.message_id, std::memory_order_relaxed);
         return true;
       }
+      static constexpr size_t no_group = SIZE_MAX;
+      /*
+       * On the sending thread, when fragment _i of _set failed to send. Returns false once the receiver can't rebuild
+       * _set any more, i.e. on any failure without FEC, or on a second failure in one FEC group (a group is its data
+       * fragments followed by their parity fragment), so that the rest of it isn't sent for nothing.
+       */
+      bool on_send_failed(const FragmentSet& _set, size_t _i, size_t& _failed_group) {
+        n_send_failures.fetch_add(1, std::memory_order_relaxed);
+        const size_t g = _set.fec_group_size;
+        const size_t group = g ? _i / (g + 1) : 0;
+        const bool recoverable = g && group != _failed_group;
+        _failed_group = group;
+        if (!recoverable) {
+          n_send_failure_drops.fetch_add(1, std::memory_order_relaxed);
+          log(LogLvl::Warn, "NS", "%s send failed, dropping message %llu after %zu/%zu fragments", name.c_str(), _set.message_id, _i + 1, _set.num_fragments());
+        }
+        return recoverable;
+      }
+      /*
+       * On the sending thread, when the fragments of _set from _first on won't be sent
+       */
+      void drop_rest(const FragmentSet& _set, size_t _first) {
+        size_t n_bytes = 0;
+        for (size_t i = _first; i < _set.num_fragments(); i++) n_bytes += _set.sizes[i];
+        queued_bytes.fetch_sub(n_bytes, std::memory_order_relaxed);
+      }
+      /*
+       * On the sending thread, before the first fragment of _set
+       */
+      bool replaced(const FragmentSet& _set) {
+        if (_set.is_control || _set.message_id >= replace_before.load(std::memory_order_relaxed)) return false;
+        queued_bytes.fetch_sub(_set.total_bytes, std::memory_order_relaxed);
+        n_admission_drops.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+      bool enqueue(const string& _peer_id, FragmentSetPtr _set) {
+        if (flow) return enqueue_scheduled(std::move(_set));
+        auto* head = current_head();
+        const size_t n_bytes = _set->total_bytes;
+        *head = std::move(_set);
+        queued_bytes.fetch_add(n_bytes, std::memory_order_relaxed);
+        if (!try_advance_head()) {
+          log(LogLvl::Warn, "NS", "%s frag send_to_peer buffer full, dropping message %llu", _peer_id.c_str(), (*head)->message_id);
+          n_queue_drops.fetch_add(1, std::memory_order_relaxed);
+          queued_bytes.fetch_sub(n_bytes, std::memory_order_relaxed);
+          head->reset();
+          return false;
+        }
+        return true;
+      }
+      Pacer pacer;
+      std::atomic<bool> rate_set{ false };
+      // set_send_rate() was given a burst, otherwise it follows the fragment size
+      std::atomic<bool> burst_set{ false };
+      std::atomic<size_t> last_frag_size{ 0 };
+      std::atomic<size_t> fec_group_size{ 0 };
+      FragmentSetPool pool;
+      std::atomic<Admission> admission{ Admission::QueueAll };
+      std::atomic<double> max_delay_s{ 0 };
+      std::atomic<uint64_t> n_admission_drops{ 0 };
+      std::atomic<uint64_t> n_queue_drops{ 0 };
+      std::atomic<uint64_t> n_send_failures{ 0 };
+      std::atomic<uint64_t> n_send_failure_drops{ 0 };
+      // Bytes queued and not sent yet
+      std::atomic<size_t> queued_bytes{ 0 };
+      // Data messages with a lower id are skipped (Admission::ReplaceQueued)
+      std::atomic<unsigned long long> replace_before{ 0 };
+      // Only used by the thread calling send()
+      std::chrono::steady_clock::time_point last_send{};
+      double send_interval_s = 0;
+      std::function<bool(BufReader*)> single_send;
+      // For the log
+      const string name;
+      SendScheduler* scheduler = nullptr;
+      SendFlow* flow = nullptr;
+      bool enqueue_scheduled(FragmentSetPtr _set);
+      void leave_scheduler();
     };
   }
-}
\ No newline at end of file
+}
+
+#include "netstream_scheduler.hpp"
\ No newline at end of file
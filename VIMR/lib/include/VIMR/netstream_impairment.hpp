@@ -0,0 +1,242 @@
+#pragma once
+
+#include <deque>
+#include <queue>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+namespace VIMR {
+  namespace Network {
+    /*
+     * What Impairment does to each datagram. Everything defaults to a perfect link.
+     */
+    struct ImpairmentConfig {
+      // Independent loss probability per datagram
+      double loss = 0;
+      // Burst loss (Gilbert-Elliott): probability per datagram of entering a burst, and the mean burst length
+      // in datagrams. Every datagram in a burst is lost.
+      double burst_loss = 0;
+      double burst_len = 1;
+      // Probability that a datagram is held back until reorder_depth later datagrams have overtaken it
+      double reorder = 0;
+      size_t reorder_depth = 3;
+      // Probability that a datagram arrives twice
+      double duplicate = 0;
+      // One way delay, plus uniform random jitter in [0, jitter_ms]. Jitter doesn't reorder datagrams unless
+      // jitter_reorders is set.
+      double delay_ms = 0;
+      double jitter_ms = 0;
+      bool jitter_reorders = false;
+      // Bottleneck rate in bytes/s (0 = unlimited), and the bottleneck queue size in bytes (drop-tail)
+      double bandwidth = 0;
+      size_t queue_bytes = 1 << 20;
+      // Datagrams held back for reordering are released after this long even if no more datagrams are sent
+      double reorder_timeout_ms = 50;
+      uint64_t seed = 1;
+    };
+
+    struct ImpairmentStats {
+      uint64_t submitted{};
+      uint64_t delivered{};
+      uint64_t lost{};
+      uint64_t lost_burst{};
+      uint64_t dropped_queue{};
+      uint64_t duplicated{};
+      uint64_t reordered{};
+    };
+
+    /*
+     * Emulates a bad link between a send function and a receive callback, e.g.
+     *
+     *   Impairment link(cfg, [&](const char* _d, size_t _n) { assembler.receive(_d, _n); });
+     *   MessageFragmenter sender([&](BufReader* _b) { link.submit(_b->read_ptr(), _b->read_headroom()); return true; }, "impaired");
+     *
+     * Which datagrams are lost, duplicated or reordered only depends on the seed and the order of submit() calls,
+     * so runs are repeatable. Datagrams are copied on submit() and handed to _deliver on the link's own thread,
+     * in order of their arrival time.
+     */
+    class Impairment {
+      using clock = std::chrono::steady_clock;
+     public:
+      using Deliver = std::function<void(const char*, size_t)>;
+
+      Impairment(const ImpairmentConfig& _cfg, const Deliver& _deliver) : cfg(_cfg), deliver(_deliver), rng(_cfg.seed) {
+        running = true;
+        delivery_thread = std::thread([this]() { delivery_loop(); });
+      }
+      Impairment(const Impairment&) = delete;
+      ~Impairment() {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          running = false;
+        }
+        cv.notify_all();
+        if (delivery_thread.joinable()) delivery_thread.join();
+      }
+
+      /*
+       * Called by the sender for every datagram. Never blocks on the link.
+       */
+      void submit(const char* _d, size_t _n) {
+        std::unique_lock<std::mutex> lock(mutex);
+        const auto now = clock::now();
+        stats.submitted++;
+        seq++;
+
+        if (in_burst) {
+          if (uniform() < 1.0 / std::max(1.0, cfg.burst_len)) in_burst = false;
+        }
+        else if (cfg.burst_loss > 0 && uniform() < cfg.burst_loss) in_burst = true;
+        // Draw every random number for every datagram, so that changing one setting doesn't shift the others
+        const bool lose = uniform() < cfg.loss;
+        const bool dup = uniform() < cfg.duplicate;
+        const bool hold = uniform() < cfg.reorder;
+        const double jitter = uniform() * cfg.jitter_ms;
+        const double dup_jitter = uniform() * cfg.jitter_ms;
+
+        if (in_burst) stats.lost_burst++;
+        else if (lose) stats.lost++;
+        else {
+          auto t = link_arrival(now, _n, jitter);
+          if (t == clock::time_point{}) stats.dropped_queue++;
+          else if (hold) {
+            stats.reordered++;
+            held.push_back({ copy(_d, _n), t, seq + cfg.reorder_depth, now + ms(cfg.reorder_timeout_ms) });
+          }
+          else schedule(copy(_d, _n), t);
+          if (dup) {
+            auto t_dup = link_arrival(now, _n, dup_jitter);
+            if (t_dup != clock::time_point{}) {
+              stats.duplicated++;
+              schedule(copy(_d, _n), t_dup);
+            }
+          }
+        }
+        release_held(now, false);
+        lock.unlock();
+        cv.notify_one();
+      }
+
+      ImpairmentStats get_stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+      }
+
+     private:
+      struct Pending {
+        std::vector<char> data;
+        clock::time_point arrival;
+        uint64_t order;
+        bool operator>(const Pending& _o) const {
+          return arrival != _o.arrival ? arrival > _o.arrival : order > _o.order;
+        }
+      };
+      struct Held {
+        std::vector<char> data;
+        // When it would have arrived if it wasn't held, so it still pays for its time on the bottleneck
+        clock::time_point arrival;
+        uint64_t release_seq;
+        clock::time_point deadline;
+      };
+
+      ImpairmentConfig cfg;
+      Deliver deliver;
+      std::mt19937_64 rng;
+      std::uniform_real_distribution<double> dist{ 0.0, 1.0 };
+
+      std::mutex mutex;
+      std::condition_variable cv;
+      std::priority_queue<Pending, std::vector<Pending>, std::greater<Pending>> in_flight;
+      std::deque<Held> held;
+      std::vector<std::vector<char>> spare;
+      ImpairmentStats stats;
+      uint64_t seq = 0;
+      uint64_t order = 0;
+      bool in_burst = false;
+      clock::time_point link_free{};
+      clock::time_point last_arrival{};
+      bool running = false;
+      std::thread delivery_thread;
+
+      static clock::duration ms(double _ms) {
+        return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(_ms));
+      }
+      double uniform() {
+        return dist(rng);
+      }
+      std::vector<char> copy(const char* _d, size_t _n) {
+        std::vector<char> v;
+        if (!spare.empty()) {
+          v = std::move(spare.back());
+          spare.pop_back();
+        }
+        v.assign(_d, _d + _n);
+        return v;
+      }
+      /*
+       * When a datagram of _n bytes sent at _now arrives, or time_point{} if the bottleneck queue is full
+       */
+      clock::time_point link_arrival(clock::time_point _now, size_t _n, double _jitter_ms) {
+        auto t = _now;
+        if (cfg.bandwidth > 0) {
+          if (link_free < _now) link_free = _now;
+          const double backlog = std::chrono::duration<double>(link_free - _now).count() * cfg.bandwidth;
+          if (backlog + static_cast<double>(_n) > static_cast<double>(cfg.queue_bytes)) return {};
+          link_free += ms(1000.0 * static_cast<double>(_n) / cfg.bandwidth);
+          t = link_free;
+        }
+        t += ms(cfg.delay_ms + _jitter_ms);
+        if (!cfg.jitter_reorders) {
+          t = std::max(t, last_arrival);
+          last_arrival = t;
+        }
+        return t;
+      }
+      void schedule(std::vector<char>&& _d, clock::time_point _t) {
+        in_flight.push({ std::move(_d), _t, order++ });
+      }
+      /*
+       * Moves held datagrams which have been overtaken often enough (or for too long) behind the newest arrival
+       */
+      void release_held(clock::time_point _now, bool _timeout_only) {
+        for (auto it = held.begin(); it != held.end();) {
+          if ((!_timeout_only && it->release_seq <= seq) || it->deadline <= _now) {
+            const auto t = std::max({ it->arrival, _now, last_arrival });
+            if (!cfg.jitter_reorders) last_arrival = t;
+            schedule(std::move(it->data), t);
+            it = held.erase(it);
+          }
+          else ++it;
+        }
+      }
+      void delivery_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (running) {
+          const auto now = clock::now();
+          release_held(now, true);
+          if (!in_flight.empty() && in_flight.top().arrival <= now) {
+            auto d = std::move(const_cast<Pending&>(in_flight.top()).data);
+            in_flight.pop();
+            stats.delivered++;
+            lock.unlock();
+            deliver(d.data(), d.size());
+            lock.lock();
+            spare.push_back(std::move(d));
+            continue;
+          }
+          auto wake = in_flight.empty() ? now + std::chrono::milliseconds(100) : in_flight.top().arrival;
+          for (const auto& h: held) wake = std::min(wake, h.deadline);
+          cv.wait_until(lock, wake);
+        }
+      }
+    };
+  }
+}
@@ -0,0 +1,271 @@
+#pragma once
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <condition_variable>
+#include "vnet.hpp"
+#include "serialbuffer.hpp"
+#include "async_log.hpp"
+#include "netstream_impairment.hpp"
+#ifdef __linux__
+#include "netstream_udpsender_posix_sockimpl.hpp"
+#endif
+
+namespace VIMR {
+  namespace Network {
+    /*
+     * One end of a loopback link, shared between its LoopbackNet and the hub so that a sender can still push
+     * into it while the receiving LoopbackNet is being destroyed.
+     */
+    struct LoopbackEndpoint {
+      string id;
+      string peer;
+      // Receive port in UDP mode
+      string port;
+
+      std::mutex mutex;
+      std::condition_variable cv;
+      std::deque<std::vector<char>> inbox;
+      std::vector<std::vector<char>> spare;
+      size_t max_queued = 4096;
+      bool closed = false;
+      std::atomic<uint64_t> n_dropped{ 0 };
+
+      /*
+       * Copies a datagram into the inbox, or drops it if the inbox is full (like a full socket buffer would)
+       */
+      bool push(const char* _d, size_t _n) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (closed || inbox.size() >= max_queued) {
+          n_dropped.fetch_add(1, std::memory_order_relaxed);
+          return false;
+        }
+        std::vector<char> dgram;
+        if (!spare.empty()) {
+          dgram = std::move(spare.back());
+          spare.pop_back();
+        }
+        dgram.assign(_d, _d + _n);
+        inbox.push_back(std::move(dgram));
+        lock.unlock();
+        cv.notify_one();
+        return true;
+      }
+    };
+
+    /*
+     * In-process rendezvous for LoopbackNet: endpoints register under their id, two endpoints are paired once
+     * each has registered with the other as its peer.
+     */
+    class LoopbackHub {
+      std::mutex mutex;
+      std::map<string, std::weak_ptr<LoopbackEndpoint>> endpoints;
+     public:
+      static LoopbackHub& instance() {
+        static LoopbackHub hub;
+        return hub;
+      }
+      bool add(const std::shared_ptr<LoopbackEndpoint>& _ep) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& slot = endpoints[_ep->id];
+        if (!slot.expired()) return false;
+        slot = _ep;
+        return true;
+      }
+      /*
+       * Only if _ep is still the endpoint registered under its id, so that an end whose add() failed doesn't
+       * unregister the one that owns the id
+       */
+      void remove(const std::shared_ptr<LoopbackEndpoint>& _ep) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = endpoints.find(_ep->id);
+        if (it == endpoints.end()) return;
+        const auto cur = it->second.lock();
+        if (!cur || cur == _ep) endpoints.erase(it);
+      }
+      std::shared_ptr<LoopbackEndpoint> find(const string& _id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = endpoints.find(_id);
+        return it == endpoints.end() ? nullptr : it->second.lock();
+      }
+    };
+
+    /*
+     * Selects VNetStream's loopback constructor
+     */
+    struct UseLoopback {};
+    inline constexpr UseLoopback use_loopback{};
+
+    /*
+     * Stand-in for VNet which connects two endpoints inside one process, without a VNet server (see VNetStream's
+     * loopback constructor). Endpoints register under _id and pair with _peer as soon as both ends exist.
+     *
+     * With LoopbackNet::inproc datagrams are copied into the peer's inbox and delivered on its receive thread.
+     * With LoopbackNet::udp (Linux only) each end binds a UDP socket on an ephemeral localhost port and
+     * datagrams go through the kernel, which includes the socket costs in benchmarks.
+     * The datagram size follows _lan like VNet's.
+     */
+    class LoopbackNet {
+     public:
+      static constexpr const char* inproc = "inproc";
+      static constexpr const char* udp = "udp";
+
+      LoopbackNet(const char* _id, const char* _peer, bool _lan, const OnRec& _on_rec, [[maybe_unused]] bool _reliable = false)
+        : lan(_lan), on_recv(_on_rec), endpoint(std::make_shared<LoopbackEndpoint>()) {
+        endpoint->id = _id;
+        endpoint->peer = _peer;
+      }
+      ~LoopbackNet() {
+        impairment.reset();
+        LoopbackHub::instance().remove(endpoint);
+        {
+          std::lock_guard<std::mutex> lock(endpoint->mutex);
+          endpoint->closed = true;
+        }
+        endpoint->cv.notify_all();
+        running = false;
+        if (recv_thread.joinable()) recv_thread.join();
+      }
+
+      /*
+       * _vnet_addr selects the mode: LoopbackNet::inproc or LoopbackNet::udp
+       */
+      bool connect_and_start_pairing(const char* _vnet_addr, [[maybe_unused]] bool _is_host = false) {
+        if (connected) return true;
+        use_udp = string(_vnet_addr) == udp;
+        if (use_udp) {
+#ifdef __linux__
+          if (!recv_sock.bind_receiver("0")) {
+            log(LogLvl::Fatal, "NS", "%s loopback failed to bind a UDP port", endpoint->id.c_str());
+            return false;
+          }
+          endpoint->port = recv_sock.local_port();
+#else
+          log(LogLvl::Fatal, "NS", "%s loopback over UDP is only available on Linux", endpoint->id.c_str());
+          return false;
+#endif
+        }
+        else if (string(_vnet_addr) != inproc) {
+          log(LogLvl::Fatal, "NS", "%s unknown loopback mode '%s'", endpoint->id.c_str(), _vnet_addr);
+          return false;
+        }
+        if (!LoopbackHub::instance().add(endpoint)) {
+          log(LogLvl::Fatal, "NS", "%s loopback endpoint already exists", endpoint->id.c_str());
+          return false;
+        }
+        running = true;
+        recv_thread = std::thread([this]() {
+          use_udp ? udp_recv_loop() : inproc_recv_loop();
+        });
+        connected = true;
+        return true;
+      }
+      bool is_connected() const {
+        return connected;
+      }
+      /*
+       * Nothing to wait for, pairing happens when the peer registers
+       */
+      bool start_pairing([[maybe_unused]] int _poll_ms = 1000, [[maybe_unused]] int _max_attempts = 5) {
+        return connected;
+      }
+      bool is_paired() {
+        auto p = LoopbackHub::instance().find(endpoint->peer);
+        return p && p->peer == endpoint->id;
+      }
+
+      bool send_to_peer(const BufReader* _b) const {
+        return send_to_peer(_b->read_ptr(), _b->read_headroom());
+      }
+      bool send_to_peer(const char* _data, uintptr_t _data_len) const {
+        if (impairment) {
+          impairment->submit(_data, _data_len);
+          return true;
+        }
+        return send_direct(_data, _data_len);
+      }
+      /*
+       * Run everything sent from this end through an emulated bad link (see netstream_impairment.hpp).
+       * Call before the first send.
+       */
+      void set_impairment(const ImpairmentConfig& _cfg) {
+        impairment = std::make_unique<Impairment>(_cfg, [this](const char* _d, size_t _n) { send_direct(_d, _n); });
+      }
+      ImpairmentStats get_impairment_stats() const {
+        return impairment ? impairment->get_stats() : ImpairmentStats{};
+      }
+
+      size_t max_frag_payload() const {
+        return (lan ? VNet::dgram_size_lan : VNet::dgram_size_wan) - VNet::frag_overhead_udp;
+      }
+      /*
+       * Datagrams which arrived while this end's inbox was full (in-process mode)
+       */
+      uint64_t n_dropped() const {
+        return endpoint->n_dropped.load(std::memory_order_relaxed);
+      }
+
+     private:
+      bool lan;
+      bool use_udp = false;
+      bool connected = false;
+      OnRec on_recv;
+      std::shared_ptr<LoopbackEndpoint> endpoint;
+      // Only used from the sending thread (the impairment's thread if there is one)
+      mutable std::weak_ptr<LoopbackEndpoint> peer_endpoint;
+      std::atomic<bool> running{ false };
+      std::thread recv_thread;
+#ifdef __linux__
+      SockIMPL recv_sock;
+      mutable SockIMPL send_sock;
+#endif
+      std::unique_ptr<Impairment> impairment;
+
+      bool send_direct(const char* _data, size_t _data_len) const {
+        auto p = peer_endpoint.lock();
+        if (!p) {
+          p = LoopbackHub::instance().find(endpoint->peer);
+          if (!p || p->peer != endpoint->id) return false;
+          peer_endpoint = p;
+        }
+        if (!use_udp) return p->push(_data, _data_len);
+#ifdef __linux__
+        if (send_sock.sock < 0 && (!send_sock.resolve("127.0.0.1", p->port) || !send_sock.open_sender())) return false;
+        return send_sock.send(_data, _data_len);
+#else
+        return false;
+#endif
+      }
+
+      void inproc_recv_loop() {
+        std::vector<char> dgram;
+        while (true) {
+          {
+            std::unique_lock<std::mutex> lock(endpoint->mutex);
+            if (!dgram.empty()) endpoint->spare.push_back(std::move(dgram));
+            endpoint->cv.wait(lock, [this]() { return endpoint->closed || !endpoint->inbox.empty(); });
+            if (endpoint->closed) return;
+            dgram = std::move(endpoint->inbox.front());
+            endpoint->inbox.pop_front();
+          }
+          on_recv(dgram.data(), dgram.size());
+        }
+      }
+      void udp_recv_loop() {
+#ifdef __linux__
+        while (running.load(std::memory_order_relaxed)) {
+          const size_t n = recv_sock.receive(100);
+          for (size_t i = 0; i < n; i++) on_recv(recv_sock.datagram(i), recv_sock.datagram_size(i));
+        }
+#endif
+      }
+    };
+  }
+}
@@ -0,0 +1,309 @@
+#pragma once
+
+#include <list>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+#include "netstream_fragmenter.hpp"
+#include "pacer.hpp"
+#include "async_log.hpp"
+
+namespace VIMR {
+  namespace Network {
+    enum class SendLane : uint8_t {
+      // Short, latency critical messages (poses, RPC). Always sent before any Bulk fragment.
+      Priority,
+      // Voxel frames, shared between flows by weight
+      Bulk
+    };
+
+    /*
+     * A stream's queue in a SendScheduler
+     */
+    struct SendFlow {
+      string id;
+      SendLane lane;
+      std::function<bool(BufReader*)> send_fn;
+      unsigned weight = 1;
+
+     private:
+      friend class SendScheduler;
+      std::deque<FragmentSetPtr> queue;
+      // Not sent yet, of the messages in queue
+      size_t queued_bytes = 0;
+      size_t next_frag = 0;
+      size_t deficit = 0;
+      bool in_turn = false;
+      bool active = false;
+      bool busy = false;
+    };
+
+    /*
+     * One sending thread for the fragments of many streams, so that a pose doesn't wait behind a whole voxel
+     * frame. Every stream that uses it is a flow in one of two lanes:
+     *  - Priority flows are always served first, so a pose waits for at most one bulk fragment.
+     *  - Bulk flows share what is left by deficit round robin, in proportion to their weights.
+     * Flows within a lane take turns fragment by fragment (weighted by bytes), and all of them are paced together
+     * at the link rate (see set_rate()), which replaces the per-stream pacing of MessageFragmenter.
+     *
+     * Use MessageFragmenter::use_scheduler() (or set_scheduler() on the streams) rather than add_flow() directly.
+     * The scheduler must outlive its flows.
+     */
+    class SendScheduler {
+     public:
+      using SendFunction = std::function<bool(BufReader*)>;
+      // Messages per flow, like MessageFragmenter::queue_size
+      static constexpr size_t max_queued = 8;
+      // Bytes a flow of weight 1 may send per round; at least one LAN datagram so each turn sends something
+      static constexpr size_t quantum = 65536;
+
+      explicit SendScheduler(double _bytes_per_sec = -1, double _burst_bytes = 0) {
+        set_rate(_bytes_per_sec, _burst_bytes);
+        send_thread = std::thread([this]() { send_loop(); });
+      }
+      SendScheduler(const SendScheduler&) = delete;
+      ~SendScheduler() {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          running = false;
+        }
+        cv.notify_all();
+        if (send_thread.joinable()) send_thread.join();
+        for (auto* f: flows) delete f;
+      }
+
+      /*
+       * Bytes per second on the wire for all flows together. 0 = unpaced, < 0 = one full fragment per 700us
+       * (MessageFragmenter's default for a single stream). _burst_bytes <= 0 means four of the largest fragments.
+       */
+      void set_rate(double _bytes_per_sec, double _burst_bytes = 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        legacy_rate = _bytes_per_sec < 0;
+        burst_bytes = _burst_bytes;
+        if (!legacy_rate) pacer.set_rate(_bytes_per_sec, burst_or_default());
+        else if (max_frag_size) apply_legacy_rate();
+      }
+      double get_rate() const {
+        return pacer.get_rate();
+      }
+      /*
+       * For apply_thread_config() (threads.hpp)
+       */
+      std::thread& get_send_thread() {
+        return send_thread;
+      }
+
+      SendFlow* add_flow(const string& _id, SendLane _lane, SendFunction _send_fn, unsigned _weight = 1) {
+        auto* f = new SendFlow();
+        f->id = _id;
+        f->lane = _lane;
+        f->send_fn = std::move(_send_fn);
+        f->weight = std::max(1u, _weight);
+        std::lock_guard<std::mutex> lock(mutex);
+        flows.push_back(f);
+        return f;
+      }
+      /*
+       * Drops whatever _f still has queued. Waits if one of its fragments is being sent right now.
+       */
+      void remove_flow(SendFlow* _f) {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [_f]() { return !_f->busy; });
+        lane_of(_f).remove(_f);
+        flows.remove(_f);
+        delete _f;
+      }
+      void set_weight(SendFlow* _f, unsigned _weight) {
+        std::lock_guard<std::mutex> lock(mutex);
+        _f->weight = std::max(1u, _weight);
+      }
+      /*
+       * Queues a message of _f. Returns false (and drops it) if _f already has max_queued messages waiting.
+       * With an admission _policy other than QueueAll, a data message that would wait longer than _budget_s behind
+       * what _f has queued (at _f's share of the rate) is dropped, or replaces the messages which haven't started
+       * sending yet (see MessageFragmenter::set_admission()). _n_dropped is incremented by the number of messages
+       * dropped or replaced that way, _n_full if the message is dropped because the queue is full.
+       */
+      bool enqueue(SendFlow* _f, FragmentSetPtr _set, Admission _policy = Admission::QueueAll, double _budget_s = 0, std::atomic<uint64_t>* _n_dropped = nullptr,
+                   std::atomic<uint64_t>* _n_full = nullptr) {
+        if (_set->num_fragments() == 0) return true;
+        std::unique_lock<std::mutex> lock(mutex);
+        if (_policy != Admission::QueueAll && !_set->is_control && _budget_s > 0 && _f->queued_bytes > 0) {
+          const double rate = flow_rate(_f);
+          const double drain_s = rate > 0 ? static_cast<double>(_f->queued_bytes + _set->total_bytes) / rate : 0;
+          if (drain_s > _budget_s) {
+            if (_policy == Admission::DropNew) {
+              lock.unlock();
+              if (_n_dropped) (*_n_dropped)++;
+              log(LogLvl::LogLow, "NS", "%s link behind (%.1fms queued), dropping message %llu", _f->id.c_str(), 1e3 * drain_s, _set->message_id);
+              return false;
+            }
+            // Keep the message being sent, so only complete messages go out
+            auto it = _f->queue.begin();
+            if (it != _f->queue.end() && _f->next_frag > 0) ++it;
+            while (it != _f->queue.end()) {
+              if ((*it)->is_control) {
+                ++it;
+                continue;
+              }
+              _f->queued_bytes -= (*it)->total_bytes;
+              it = _f->queue.erase(it);
+              if (_n_dropped) (*_n_dropped)++;
+            }
+            log(LogLvl::LogLow, "NS", "%s link behind (%.1fms queued), replacing queued messages with %llu", _f->id.c_str(), 1e3 * drain_s, _set->message_id);
+          }
+        }
+        if (_f->queue.size() >= max_queued) {
+          lock.unlock();
+          if (_n_full) (*_n_full)++;
+          log(LogLvl::Warn, "NS", "%s send scheduler queue full, dropping message %llu", _f->id.c_str(), _set->message_id);
+          return false;
+        }
+        if (_set->frag_size > max_frag_size) {
+          max_frag_size = _set->frag_size;
+          if (legacy_rate) apply_legacy_rate();
+        }
+        _f->queued_bytes += _set->total_bytes;
+        _f->queue.push_back(std::move(_set));
+        if (!_f->active) {
+          _f->active = true;
+          _f->deficit = 0;
+          _f->in_turn = false;
+          lane_of(_f).push_back(_f);
+        }
+        lock.unlock();
+        cv.notify_one();
+        return true;
+      }
+
+     private:
+      std::mutex mutex;
+      std::condition_variable cv;
+      std::condition_variable idle;
+      std::list<SendFlow*> flows;
+      std::list<SendFlow*> priority_active;
+      std::list<SendFlow*> bulk_active;
+      Pacer pacer;
+      bool legacy_rate = true;
+      double burst_bytes = 0;
+      size_t max_frag_size = 0;
+      bool running = true;
+      std::thread send_thread;
+
+      std::list<SendFlow*>& lane_of(const SendFlow* _f) {
+        return _f->lane == SendLane::Priority ? priority_active : bulk_active;
+      }
+      /*
+       * What _f gets of the rate while all active flows are sending
+       */
+      double flow_rate(const SendFlow* _f) const {
+        const double rate = pacer.get_rate();
+        if (rate <= 0 || _f->lane == SendLane::Priority) return rate;
+        unsigned total = _f->active ? 0 : _f->weight;
+        for (const auto* a: bulk_active) total += a->weight;
+        return rate * _f->weight / std::max(1u, total);
+      }
+      double burst_or_default() const {
+        return burst_bytes > 0 ? burst_bytes : MessageFragmenter::default_burst_frags * static_cast<double>(max_frag_size);
+      }
+      void apply_legacy_rate() {
+        pacer.set_rate(static_cast<double>(max_frag_size) / MessageFragmenter::legacy_frag_interval_s, burst_or_default());
+      }
+      /*
+       * Deficit round robin over the active flows of one lane: the flow at the front gets weight * quantum more
+       * bytes at the start of its turn and keeps the turn while its next fragment fits.
+       */
+      SendFlow* pick(std::list<SendFlow*>& _active) {
+        while (!_active.empty()) {
+          SendFlow* f = _active.front();
+          if (f->queue.empty()) {
+            f->active = false;
+            _active.pop_front();
+            continue;
+          }
+          const size_t size = f->queue.front()->sizes[f->next_frag];
+          if (!f->in_turn) {
+            f->deficit += f->weight * quantum;
+            f->in_turn = true;
+          }
+          if (f->deficit >= size) {
+            f->deficit -= size;
+            return f;
+          }
+          f->in_turn = false;
+          _active.splice(_active.end(), _active, _active.begin());
+        }
+        return nullptr;
+      }
+      void send_loop() {
+        BufView view;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+          SendFlow* f = nullptr;
+          cv.wait(lock, [&]() {
+            if (!running) return true;
+            f = pick(priority_active);
+            if (!f) f = pick(bulk_active);
+            return f != nullptr;
+          });
+          if (!running) return;
+
+          FragmentSetPtr set = f->queue.front();
+          const size_t i = f->next_frag++;
+          f->queued_bytes -= std::min(f->queued_bytes, set->sizes[i]);
+          if (f->next_frag == set->num_fragments()) {
+            f->queue.pop_front();
+            f->next_frag = 0;
+            if (f->queue.empty()) {
+              f->active = false;
+              f->deficit = 0;
+              f->in_turn = false;
+              lane_of(f).remove(f);
+            }
+          }
+          f->busy = true;
+          lock.unlock();
+
+          pacer.pace(set->sizes[i]);
+          view.reset(set->fragment(i), set->sizes[i]);
+          f->send_fn(&view);
+          set.reset();
+
+          lock.lock();
+          f->busy = false;
+          idle.notify_all();
+        }
+      }
+    };
+
+    inline void MessageFragmenter::use_scheduler(SendScheduler* _scheduler, SendLane _lane, const string& _flow_id, unsigned _weight) {
+      scheduler = _scheduler;
+      flow = scheduler->add_flow(_flow_id, _lane, [this](BufReader* _b) {
+        if (single_send(_b)) return true;
+        n_send_failures.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      });
+      set_weight(_weight);
+    }
+    inline void MessageFragmenter::set_weight(unsigned _weight) {
+      if (flow) scheduler->set_weight(flow, _weight);
+    }
+    inline void MessageFragmenter::leave_scheduler() {
+      if (flow) scheduler->remove_flow(flow);
+      flow = nullptr;
+      scheduler = nullptr;
+    }
+    inline MessageFragmenter::~MessageFragmenter() {
+      leave_scheduler();
+    }
+    inline bool MessageFragmenter::enqueue_scheduled(FragmentSetPtr _set) {
+      return scheduler->enqueue(flow, std::move(_set), admission.load(std::memory_order_relaxed), delay_budget(), &n_admission_drops, &n_queue_drops);
+    }
+  }
+}
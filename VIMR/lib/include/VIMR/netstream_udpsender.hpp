@@ -1,5 +1,7 @@
 #pragma once
 
+#include <string>
+#include <cstdint>
 #include "netstream_fragmenter.hpp"
 #include "vimr_api.hpp"
 
@@ -7,6 +9,17 @@ namespace VIMR
 {
   namespace Network
   {
+    /*
+     * The LAN multicast group (239.255.0.0/16, organisation-local scope) for an instance ID, so that senders and
+     * viewers agree on a group without configuring addresses
+     */
+    inline string multicast_group(const string& _instance_id)
+    {
+      uint32_t h = 2166136261u;
+      for (const char c: _instance_id) h = (h ^ static_cast<uint8_t>(c)) * 16777619u;
+      return "239.255." + std::to_string((h >> 8) & 0xff) + "." + std::to_string(h & 0xff);
+    }
+
     struct SockIMPL;
     class  UDPNetStream
     {
@@ -18,10 +31,54 @@ namespace VIMR
       UDPNetStream(const string& _addr, const string& _port, bool _lan);
 
       bool open_connection() const;
+#ifdef __linux__
+      /*
+       * True if this sends to a multicast group (one send reaches every receiver that joined it). Linux only, the
+       * Windows socket code is built into the library.
+       */
+      bool is_multicast() const;
+#endif
 
       bool queue(BufReader* _b){
         return fragment_sender->send(UdpID, _b, frag_size);
       }
+      bool queue(FragmentSetPtr _set){
+        return fragment_sender->send(UdpID, std::move(_set));
+      }
+      size_t frag_payload_size() const {
+        return frag_size;
+      }
+      size_t get_fec_group_size() const {
+        return fragment_sender->get_fec_group_size();
+      }
+      void set_send_rate(double _bytes_per_sec, double _burst_bytes = 0) {
+        fragment_sender->set_send_rate(_bytes_per_sec, _burst_bytes);
+      }
+      void set_fec_group_size(size_t _group_size) {
+        fragment_sender->set_fec_group_size(_group_size);
+      }
+      void set_admission(Admission _policy, double _max_delay_s = 0) {
+        fragment_sender->set_admission(_policy, _max_delay_s);
+      }
+      uint64_t get_admission_drops() const {
+        return fragment_sender->get_admission_drops();
+      }
+      uint64_t get_queue_drops() const {
+        return fragment_sender->get_queue_drops();
+      }
+      /*
+       * Call before the first queue() (see MessageFragmenter::use_scheduler())
+       */
+      void set_scheduler(SendScheduler* _scheduler, SendLane _lane, unsigned _weight = 1) {
+        fragment_sender->use_scheduler(_scheduler, _lane, UdpID, _weight);
+      }
+      void set_weight(unsigned _weight) {
+        fragment_sender->set_weight(_weight);
+      }
     };
   }
-}
\ No newline at end of file
+}
+
+#ifdef __linux__
+#include "netstream_udpsender_posix_sockimpl.hpp"
+#endif
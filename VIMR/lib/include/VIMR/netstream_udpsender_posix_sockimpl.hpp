@@ -0,0 +1,439 @@
+#pragma once
+
+#include <string>
+#include <thread>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "netstream_udpsender.hpp"
+#include "netstream_fragmenter.hpp"
+#include "async_log.hpp"
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+namespace VIMR
+{
+  namespace Network
+  {
+    /*
+     * Linux UDP socket for UDPNetStream and UDPNetReceiver.
+     *
+     * Fragments are sent with one sendmmsg() per batch. With GSO, each run of full-size fragments (plus the
+     * shorter last fragment of a message) is handed to the kernel as one UDP_SEGMENT message, which the kernel
+     * (or NIC) splits into datagrams of exactly frag_size bytes, so the wire format doesn't change.
+     * If the route doesn't support GSO the first send fails with EIO and the socket falls back to one message per fragment.
+     *
+     * Receiving uses recvmmsg() into a slab of datagram buffers that is set up once in bind_receiver().
+     */
+    struct SockIMPL
+    {
+      static constexpr size_t max_batch = 64;
+      // Largest UDP payload over IPv4
+      static constexpr size_t max_datagram = 65507;
+      // Kernel limit on segments per GSO message (UDP_MAX_SEGMENTS)
+      static constexpr size_t max_gso_segments = 64;
+      // Fits a 1500 byte MTU with IPv4 and UDP headers, like VNet's WAN datagrams
+      static constexpr size_t default_frag_size = VNet::dgram_size_wan - VNet::frag_overhead_udp;
+      // Like VNet's LAN datagrams, which IP fragments on the wire
+      static constexpr size_t lan_frag_size = std::min(VNet::dgram_size_lan - VNet::frag_overhead_udp, max_datagram);
+
+      int sock = -1;
+      sockaddr_storage address{};
+      socklen_t address_len = 0;
+      bool use_gso = true;
+      // For multicast destinations: 1 keeps datagrams on the local network, loop lets viewers on this machine receive
+      int multicast_ttl = 1;
+      bool multicast_loop = true;
+
+      SockIMPL() = default;
+      SockIMPL(const SockIMPL&) = delete;
+      ~SockIMPL()
+      {
+        if (sock >= 0) ::close(sock);
+        delete[] recv_slab;
+      }
+
+      bool resolve(const std::string& _addr, const std::string& _port)
+      {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_protocol = IPPROTO_UDP;
+        addrinfo* res = nullptr;
+        if (getaddrinfo(_addr.c_str(), _port.c_str(), &hints, &res) != 0 || !res) return false;
+        memcpy(&address, res->ai_addr, res->ai_addrlen);
+        address_len = static_cast<socklen_t>(res->ai_addrlen);
+        freeaddrinfo(res);
+        return true;
+      }
+      /*
+       * Creates the socket and connects it to the resolved address, so sends don't have to carry the address
+       */
+      bool open_sender()
+      {
+        if (sock >= 0) return true;
+        sock = ::socket(address.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+        if (sock < 0) return false;
+        if (::connect(sock, reinterpret_cast<const sockaddr*>(&address), address_len) != 0)
+        {
+          ::close(sock);
+          sock = -1;
+          return false;
+        }
+        if (is_multicast()) {
+          const int loop = multicast_loop ? 1 : 0;
+          if (address.ss_family == AF_INET6) {
+            setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &multicast_ttl, sizeof(multicast_ttl));
+            setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop));
+          }
+          else {
+            const auto ttl = static_cast<unsigned char>(multicast_ttl);
+            const auto loop_c = static_cast<unsigned char>(loop);
+            setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+            setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop_c, sizeof(loop_c));
+          }
+        }
+        // Probe for GSO support (Linux 4.18+)
+        int seg = 0;
+        if (use_gso && setsockopt(sock, SOL_UDP, UDP_SEGMENT, &seg, sizeof(seg)) != 0) use_gso = false;
+        return true;
+      }
+
+      /*
+       * Sends _n fragments of at most _frag_size bytes each, returns how many were sent
+       */
+      size_t send(BufReader* const* _bufs, size_t _n, size_t _frag_size)
+      {
+        size_t n_sent = 0;
+        while (n_sent < _n)
+        {
+          const size_t k = send_batch(_bufs + n_sent, std::min(_n - n_sent, max_batch), _frag_size);
+          if (k == 0) break;
+          n_sent += k;
+        }
+        return n_sent;
+      }
+
+      bool send(const char* _d, size_t _n)
+      {
+        ssize_t r;
+        do r = ::send(sock, _d, _n, 0); while (r < 0 && errno == EINTR);
+        return r == static_cast<ssize_t>(_n);
+      }
+
+      /*
+       * Binds to _port on all interfaces and sets up _n_slots receive buffers of _slot_size bytes
+       */
+      bool bind_receiver(const std::string& _port, size_t _n_slots = max_batch, size_t _slot_size = max_datagram)
+      {
+        addrinfo hints{};
+        hints.ai_family = AF_INET6;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo* res = nullptr;
+        if (getaddrinfo(nullptr, _port.c_str(), &hints, &res) != 0 || !res) return false;
+        sock = ::socket(res->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+        int v6only = 0;
+        if (sock >= 0) setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+        const bool ok = sock >= 0 && ::bind(sock, res->ai_addr, res->ai_addrlen) == 0;
+        freeaddrinfo(res);
+        if (!ok) return false;
+        setup_recv_slots(_n_slots, _slot_size);
+        return true;
+      }
+      /*
+       * Binds to _port and joins the multicast group _group (IPv4 or IPv6). Several receivers on one machine
+       * can join the same group and port.
+       */
+      bool bind_multicast_receiver(const std::string& _group, const std::string& _port, size_t _n_slots = max_batch, size_t _slot_size = max_datagram)
+      {
+        if (!resolve(_group, _port) || !is_multicast()) return false;
+        sock = ::socket(address.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+        if (sock < 0) return false;
+        const int reuse = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        bool ok;
+        if (address.ss_family == AF_INET6)
+        {
+          sockaddr_in6 any{};
+          any.sin6_family = AF_INET6;
+          any.sin6_port = reinterpret_cast<const sockaddr_in6*>(&address)->sin6_port;
+          ipv6_mreq mreq{};
+          mreq.ipv6mr_multiaddr = reinterpret_cast<const sockaddr_in6*>(&address)->sin6_addr;
+          ok = ::bind(sock, reinterpret_cast<const sockaddr*>(&any), sizeof(any)) == 0 &&
+               setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) == 0;
+        }
+        else
+        {
+          sockaddr_in any{};
+          any.sin_family = AF_INET;
+          any.sin_port = reinterpret_cast<const sockaddr_in*>(&address)->sin_port;
+          any.sin_addr.s_addr = htonl(INADDR_ANY);
+          ip_mreq mreq{};
+          mreq.imr_multiaddr = reinterpret_cast<const sockaddr_in*>(&address)->sin_addr;
+          mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+          ok = ::bind(sock, reinterpret_cast<const sockaddr*>(&any), sizeof(any)) == 0 &&
+               setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == 0;
+        }
+        if (!ok)
+        {
+          ::close(sock);
+          sock = -1;
+          return false;
+        }
+        setup_recv_slots(_n_slots, _slot_size);
+        return true;
+      }
+      /*
+       * Largest UDP payload that fits the MTU of the connected route, 0 if unknown
+       */
+      size_t route_payload_limit() const
+      {
+        int mtu = 0;
+        socklen_t len = sizeof(mtu);
+        const bool v6 = address.ss_family == AF_INET6;
+        if (sock < 0 || getsockopt(sock, v6 ? IPPROTO_IPV6 : IPPROTO_IP, v6 ? IPV6_MTU : IP_MTU, &mtu, &len) != 0) return 0;
+        const int headers = (v6 ? 40 : 20) + 8;
+        return mtu > headers ? static_cast<size_t>(mtu - headers) : 0;
+      }
+      bool is_multicast() const
+      {
+        if (address.ss_family == AF_INET6) return IN6_IS_ADDR_MULTICAST(&reinterpret_cast<const sockaddr_in6*>(&address)->sin6_addr);
+        if (address.ss_family == AF_INET) return IN_MULTICAST(ntohl(reinterpret_cast<const sockaddr_in*>(&address)->sin_addr.s_addr));
+        return false;
+      }
+      /*
+       * Waits up to _timeout_ms for datagrams and receives as many as are queued (up to the number of slots).
+       * Returns the number received, the data is in datagram(i) until the next call.
+       * Datagrams larger than a slot are dropped rather than passed on cut short.
+       */
+      size_t receive(int _timeout_ms)
+      {
+        pollfd pfd{ sock, POLLIN, 0 };
+        if (::poll(&pfd, 1, _timeout_ms) <= 0) return 0;
+        const int n = ::recvmmsg(sock, recv_msgs, static_cast<unsigned>(n_recv_slots), MSG_DONTWAIT, nullptr);
+        size_t n_good = 0;
+        for (int i = 0; i < n; i++)
+        {
+          if (recv_msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+          {
+            log(LogLvl::Warn, "NS", "UDP datagram larger than %zu bytes dropped", recv_slot_size);
+            continue;
+          }
+          recv_good[n_good++] = static_cast<size_t>(i);
+        }
+        return n_good;
+      }
+      /*
+       * The port the socket is bound to, e.g. after binding to port "0"
+       */
+      std::string local_port() const
+      {
+        sockaddr_storage addr{};
+        socklen_t len = sizeof(addr);
+        if (sock < 0 || ::getsockname(sock, reinterpret_cast<sockaddr*>(&addr), &len) != 0) return {};
+        const uint16_t port = addr.ss_family == AF_INET6 ? reinterpret_cast<const sockaddr_in6*>(&addr)->sin6_port : reinterpret_cast<const sockaddr_in*>(&addr)->sin_port;
+        return std::to_string(ntohs(port));
+      }
+      const char* datagram(size_t _i) const
+      {
+        return static_cast<const char*>(recv_iovs[recv_good[_i]].iov_base);
+      }
+      size_t datagram_size(size_t _i) const
+      {
+        return recv_msgs[recv_good[_i]].msg_len;
+      }
+
+    private:
+      static constexpr size_t ctrl_size = CMSG_SPACE(sizeof(uint16_t));
+      mmsghdr send_msgs[max_batch]{};
+      iovec send_iovs[max_batch]{};
+      // Index of the first fragment of each message, to map partial sends back to fragments
+      size_t send_first[max_batch + 1]{};
+      alignas(cmsghdr) char send_ctrl[max_batch][ctrl_size]{};
+
+      mmsghdr recv_msgs[max_batch]{};
+      iovec recv_iovs[max_batch]{};
+      // Slots of the datagrams returned by the last receive()
+      size_t recv_good[max_batch]{};
+      char* recv_slab = nullptr;
+      size_t n_recv_slots = 0;
+      size_t recv_slot_size = 0;
+
+      void setup_recv_slots(size_t _n_slots, size_t _slot_size)
+      {
+        n_recv_slots = std::min(_n_slots, max_batch);
+        recv_slot_size = _slot_size;
+        recv_slab = new char[n_recv_slots * recv_slot_size];
+        for (size_t i = 0; i < n_recv_slots; i++)
+        {
+          recv_iovs[i].iov_base = recv_slab + i * recv_slot_size;
+          recv_iovs[i].iov_len = recv_slot_size;
+          recv_msgs[i].msg_hdr = msghdr{};
+          recv_msgs[i].msg_hdr.msg_iov = &recv_iovs[i];
+          recv_msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+      }
+      size_t send_batch(BufReader* const* _bufs, size_t _n, size_t _frag_size)
+      {
+        const size_t max_segs = std::min(max_gso_segments, max_datagram / std::max<size_t>(_frag_size, 1));
+        size_t n_msgs = 0;
+        size_t i = 0;
+        while (i < _n)
+        {
+          size_t k = 1;
+          size_t total = _bufs[i]->read_headroom();
+          if (use_gso && total == _frag_size)
+          {
+            while (i + k < _n && k < max_segs)
+            {
+              const size_t len = _bufs[i + k]->read_headroom();
+              if (len > _frag_size) break;
+              total += len;
+              k++;
+              // A shorter fragment can only be the last segment
+              if (len < _frag_size) break;
+            }
+          }
+          for (size_t j = 0; j < k; j++)
+          {
+            send_iovs[i + j].iov_base = const_cast<char*>(_bufs[i + j]->read_ptr());
+            send_iovs[i + j].iov_len = _bufs[i + j]->read_headroom();
+          }
+          msghdr& h = send_msgs[n_msgs].msg_hdr;
+          h = msghdr{};
+          h.msg_iov = &send_iovs[i];
+          h.msg_iovlen = k;
+          if (k > 1)
+          {
+            h.msg_control = send_ctrl[n_msgs];
+            h.msg_controllen = ctrl_size;
+            cmsghdr* cm = CMSG_FIRSTHDR(&h);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            const auto seg = static_cast<uint16_t>(_frag_size);
+            memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+          }
+          send_first[n_msgs] = i;
+          i += k;
+          n_msgs++;
+        }
+        send_first[n_msgs] = i;
+
+        size_t msgs_sent = 0;
+        while (msgs_sent < n_msgs)
+        {
+          const int r = ::sendmmsg(sock, send_msgs + msgs_sent, static_cast<unsigned>(n_msgs - msgs_sent), 0);
+          if (r > 0)
+          {
+            msgs_sent += static_cast<size_t>(r);
+            continue;
+          }
+          if (errno == EINTR) continue;
+          if (errno == EIO && use_gso)
+          {
+            log(LogLvl::Warn, "NS", "UDP GSO not supported on this route, sending fragments individually");
+            use_gso = false;
+            const size_t done = send_first[msgs_sent];
+            return done + send_batch(_bufs + done, _n - done, _frag_size);
+          }
+          else
+          {
+            log(LogLvl::Warn, "NS", "UDP sendmmsg failed: %s", strerror(errno));
+          }
+          break;
+        }
+        return send_first[msgs_sent];
+      }
+    };
+
+    inline UDPNetStream::UDPNetStream(const string& _addr, const string& _port, bool _lan)
+      : __impl(new SockIMPL()), UdpID("UDP:" + _addr + ":" + _port), frag_size(_lan ? SockIMPL::lan_frag_size : SockIMPL::default_frag_size)
+    {
+      if (!__impl->resolve(_addr, _port))
+      {
+        delete __impl;
+        throw std::exception();
+      }
+      // Over WAN, datagrams larger than the route's MTU fail with EMSGSIZE (and can't be GSO segments), so stay
+      // below it. LAN datagrams are bigger on purpose and left to IP fragmentation.
+      if (__impl->open_sender() && !_lan)
+      {
+        if (const size_t limit = __impl->route_payload_limit()) frag_size = std::min(frag_size, limit);
+      }
+      fragment_sender = new MessageFragmenter([this](BufReader* const* _bufs, size_t _n) {
+        return __impl->send(_bufs, _n, frag_size);
+      }, (UdpID + ":fragmenter").c_str());
+    }
+    inline bool UDPNetStream::open_connection() const
+    {
+      return __impl->open_sender();
+    }
+    inline bool UDPNetStream::is_multicast() const
+    {
+      return __impl->is_multicast();
+    }
+
+    /*
+     * Receiving end of a UDPNetStream: reassembles the fragments sent to _port into _consumer.
+     * With a multicast _group (see multicast_group()) it joins the group instead, so any number of receivers get
+     * the same datagrams from a single send.
+     */
+    template<class SERIAL_T>
+    class UDPNetReceiver
+    {
+      SockIMPL sock_impl;
+      string id;
+      MessageAssembler<SERIAL_T>* fragment_assembler{};
+      std::thread recv_thread;
+      std::atomic<bool> running{ false };
+    public:
+      UDPNetReceiver(const string& _port, RingBuffer<SERIAL_T>* _consumer) : id("UDP:" + _port)
+      {
+        if (!sock_impl.bind_receiver(_port)) throw std::exception();
+        start(_consumer);
+      }
+      UDPNetReceiver(const string& _group, const string& _port, RingBuffer<SERIAL_T>* _consumer) : id("UDP:" + _group + ":" + _port)
+      {
+        if (!sock_impl.bind_multicast_receiver(_group, _port))
+        {
+          log(LogLvl::Fatal, "NS", "%s failed to join multicast group", id.c_str());
+          throw std::exception();
+        }
+        start(_consumer);
+      }
+      ~UDPNetReceiver()
+      {
+        running = false;
+        if (recv_thread.joinable()) recv_thread.join();
+        fragment_assembler->release();
+        delete fragment_assembler;
+      }
+    private:
+      void start(RingBuffer<SERIAL_T>* _consumer)
+      {
+        fragment_assembler = new MessageAssembler<SERIAL_T>(id, _consumer);
+        running = true;
+        recv_thread = std::thread([this]() {
+          while (running.load(std::memory_order_relaxed))
+          {
+            const size_t n = sock_impl.receive(100);
+            for (size_t i = 0; i < n; i++) fragment_assembler->receive(sock_impl.datagram(i), sock_impl.datagram_size(i));
+          }
+        });
+      }
+    };
+  }
+}
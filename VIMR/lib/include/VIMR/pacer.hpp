@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+namespace VIMR {
+  /*
+   * Sleep until _deadline with better precision than sleep_for alone: sleeps until _spin_us before the
+   * deadline (OS timer granularity is ~1ms on Windows, ~50us on Linux) and spins with yield() for the rest.
+   */
+  inline void precise_sleep_until(std::chrono::steady_clock::time_point _deadline, long _spin_us = 1000) {
+    using clk = std::chrono::steady_clock;
+    const auto coarse = _deadline - std::chrono::microseconds(_spin_us);
+    if (clk::now() < coarse) std::this_thread::sleep_until(coarse);
+    while (clk::now() < _deadline) std::this_thread::yield();
+  }
+
+  /*
+   * Token bucket rate limiter for one sending thread.
+   *
+   * pace(n) is called before sending n bytes. Up to burst bytes go out back-to-back, after that the caller is
+   * held back so that the average rate doesn't exceed the target rate. A rate of 0 disables pacing.
+   *
+   * set_rate() may be called from any thread, pace() must only be called from one thread.
+   */
+  class Pacer {
+   public:
+    Pacer() = default;
+    Pacer(double _bytes_per_sec, double _burst_bytes) {
+      set_rate(_bytes_per_sec, _burst_bytes);
+    }
+    void set_rate(double _bytes_per_sec, double _burst_bytes) {
+      burst.store(std::max(0.0, _burst_bytes), std::memory_order_relaxed);
+      rate.store(std::max(0.0, _bytes_per_sec), std::memory_order_relaxed);
+    }
+    double get_rate() const {
+      return rate.load(std::memory_order_relaxed);
+    }
+    double get_burst() const {
+      return burst.load(std::memory_order_relaxed);
+    }
+    /*
+     * Blocks until _n_bytes are allowed to be sent
+     */
+    void pace(size_t _n_bytes) {
+      const auto now = std::chrono::steady_clock::now();
+      const double r = rate.load(std::memory_order_relaxed);
+      if (r <= 0) {
+        last_refill = now;
+        tokens = 0;
+        return;
+      }
+      const double b = burst.load(std::memory_order_relaxed);
+      const double dt = std::chrono::duration<double>(now - last_refill).count();
+      last_refill = now;
+      tokens = std::min(b, tokens + dt * r) - static_cast<double>(_n_bytes);
+      if (tokens >= 0) return;
+      /*
+       * In debt: wait until the bucket is back at zero. The next call refills from 'now', which accounts for the wait,
+       * so oversleeping is made up from the burst rather than lowering the rate. Spin for at most a quarter of the
+       * wait, otherwise short waits (e.g. one fragment per 700us) would be spun through entirely.
+       */
+      const double wait_s = -tokens / r;
+      const long spin = std::min(spin_us, static_cast<long>(wait_s * 1e6 / 4));
+      precise_sleep_until(now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(wait_s)), spin);
+    }
+
+    // How long before each deadline to stop sleeping and start spinning, at most (see pace())
+    long spin_us = 1000;
+
+   private:
+    std::atomic<double> rate{ 0 };
+    std::atomic<double> burst{ 0 };
+    double tokens = 0;
+    std::chrono::steady_clock::time_point last_refill = std::chrono::steady_clock::now();
+  };
+}
@@ -9,7 +9,12 @@
 #pragma once
 #include <any>
 #include <map>
+#include <mutex>
 #include <tuple>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <thread>
 #include <string>
 #include <utility>
 #include <vector>
@@ -19,6 +24,7 @@
 #include <optional>
 #include <exception>
 #include <functional>
+#include <condition_variable>
 
 using std::map;
 using std::string;
@@ -57,6 +63,7 @@ namespace prpc {
 
   class invoker;
   class caller;
+  class async_caller;
 
   class serial_message {
    protected:
@@ -75,6 +82,7 @@ namespace prpc {
    protected:
     friend class invoker;
     friend class caller;
+    friend class async_caller;
     template<typename ... T, std::size_t ... I>
     void extract_args_tuple(std::tuple<T ...>& _tuple, std::index_sequence<I ...>) {
       (extract_arg_value(std::get<I>(_tuple)), ... );
@@ -103,6 +111,7 @@ namespace prpc {
    protected:
     friend class invoker;
     friend class caller;
+    friend class async_caller;
     template<typename T>
     std::enable_if_t<std::is_same_v<std::decay_t<T>, std::string>, void>
     reinit(T const& _value) {
@@ -174,6 +183,22 @@ namespace prpc {
       std::apply(std::move(_func), std::move(_args));
       _resp.reinit("PRPC_GOOD");
     }
+    template<typename FUN_T>
+    static function<void(from_serial&, to_serial&)> wrap(FUN_T _fun) {
+      return [fun = std::move(_fun)](from_serial& _inv_params, to_serial& _resp) {
+        std::function func{ std::move(fun) };
+
+        using function_signature = function_signature<decltype(func)>;
+        using args_tupl_t = typename function_signature::args_tupl_t;
+
+        args_tupl_t data;
+        _inv_params.extract(data);
+
+        if (_inv_params.has_conv_failed()) _resp.reinit("PRPC_INV_ARG_EXTRACT_FAILED");
+        else apply_optional_return(std::move(func), std::move(data), _resp);
+      };
+    }
+
     map<string, function<void(from_serial&, to_serial&)>> wrapped_functions;
     transport_sendrec_f rec_fun;
     transport_send_f send_fun;
@@ -209,27 +234,22 @@ namespace prpc {
       //TODO: derive argspec from to_serial, right now it is defined elsewhere
       if (wrapped_functions.count(_fun_id) != 0) throw std::exception();
 
-      auto fun_wrap = [fun = std::move(_fun)](from_serial& _inv_params, to_serial& _resp) {
-        std::function func{ std::move(fun) };
-
-        using function_signature = function_signature<decltype(func)>;
-        using args_tupl_t = typename function_signature::args_tupl_t;
-
-        args_tupl_t data;
-        _inv_params.extract(data);
-
-        if (_inv_params.has_conv_failed()) _resp.reinit("PRPC_INV_ARG_EXTRACT_FAILED");
-        else apply_optional_return(std::move(func), std::move(data), _resp);
-      };
-
-      wrapped_functions[_fun_id] = std::move(fun_wrap);
+      wrapped_functions[_fun_id] = wrap(std::move(_fun));
       func_argstr.push_back(_argspec_json);
       funiter = func_argstr.begin();
     }
 
+    /*
+     * A request may start with "#<request id> " (see async_caller), which is put in front of its response
+     */
     void invoke(const string& _invoke_param_str) {
       from_serial inv_params(_invoke_param_str);
       to_serial ret_param("");
+      string request_tag;
+      if (!inv_params.prefix_str.empty() && inv_params.prefix_str[0] == '#') {
+        request_tag = std::move(inv_params.prefix_str);
+        inv_params.msg_strm >> inv_params.prefix_str;
+      }
 
       if (wrapped_functions.count(inv_params.prefix_str) == 0) {
         ret_param.reinit("PRPC_INV_FUN_NOEXIST");
@@ -243,7 +263,8 @@ namespace prpc {
           ret_param.append(e.what());
         }
       }
-      send_fun(ret_param.serial());
+      if (request_tag.empty()) send_fun(ret_param.serial());
+      else send_fun(request_tag + ' ' + ret_param.serial());
     }
   };
   class caller {
@@ -275,6 +296,9 @@ namespace prpc {
     };
     from_serial* rp = nullptr;
    public:
+    /*
+     * _rec_fun returns the response, or an empty string if none came in time (TimeoutException)
+     */
     caller(transport_sendrec_f _rec_fun) {
       sendrec_fun = std::move(_rec_fun);
       //string remote_version=call("prpc-get-version");
@@ -300,6 +324,9 @@ namespace prpc {
       else if (rp->prefix_str == "PRPC_INV_ARG_EXTRACT_FAILED") {
         throw BadArgListException();
       }
+      else if (response.empty()) {
+        throw TimeoutException();
+      }
       else {
         throw UnknownInvokerException();
       }
@@ -318,9 +345,174 @@ namespace prpc {
       else if (rp->prefix_str == "PRPC_INV_ARG_EXTRACT_FAILED") {
         throw BadArgListException();
       }
+      else if (response.empty()) {
+        throw TimeoutException();
+      }
       else {
         throw UnknownInvokerException();
       }
     }
   };
+  /*
+   * Caller with any number of calls in flight on one connection. Requests are tagged "#<request id>", which
+   * the invoker echoes in front of the response, so responses may come back in any order. The transport passes
+   * every response it receives to on_response(). E.g. to set something on many components in one round trip:
+   *
+   *   vector<std::future<async_caller::result>> done;
+   *   for (auto* c: callers) done.push_back(c->call_async(200, "SendRateMbps", 400.0));
+   *   for (auto& f: done) f.get(); // throws TimeoutException if a component didn't answer within 200ms
+   *
+   * Callbacks are called exactly once, on the thread calling on_response() or on the timeout thread.
+   *
+   * Invokers built before request tags were added answer without them. Untagged responses are matched to the oldest
+   * call in flight, which works as long as the invoker answers in order, but a tagged request makes such an
+   * invoker look for a function named "#<id>": talk to it with _tag_requests false. Without tags a response that
+   * comes after its call timed out is taken for the next call's, so keep the timeouts generous there.
+   */
+  class async_caller {
+   public:
+    class result final {
+      mutable std::optional<std::any> value;
+      std::shared_ptr<from_serial> rp;
+     public:
+      result() = default;
+      explicit result(std::shared_ptr<from_serial> _rp) : rp(std::move(_rp)) {}
+      template<typename T>
+      T as() const {
+        using Type = std::decay_t<T>;
+
+        if (!value) {
+          Type data{};
+          rp->extract_arg_value(data);
+          value = std::move(data);
+        }
+
+        return std::any_cast<Type>(*value);
+      }
+      template<typename T>
+      operator T() const {
+        return as<T>();
+      }
+    };
+    // _err is null if the call succeeded
+    using callback_f = function<void(std::exception_ptr _err, const result& _res)>;
+
+    async_caller(transport_send_f _send_fun, bool _tag_requests = true) : send_fun(std::move(_send_fun)), tag_requests(_tag_requests) {
+      timeout_thread = std::thread([this]() { expire_loop(); });
+    }
+    async_caller(const async_caller&) = delete;
+    ~async_caller() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+      }
+      cv.notify_all();
+      if (timeout_thread.joinable()) timeout_thread.join();
+      for (auto&[id, p]: pending) p.callback(std::make_exception_ptr(TimeoutException()), result());
+    }
+
+    template<typename ... TArgs>
+    void call_async(callback_f _callback, unsigned long _timeout_ms, const string& _fun_id, TArgs&& ... _args) {
+      auto data = std::make_tuple(std::forward<TArgs>(_args) ...);
+      uint64_t id;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        id = ++last_id;
+        pending[id] = { std::move(_callback), std::chrono::steady_clock::now() + std::chrono::milliseconds(_timeout_ms) };
+      }
+      cv.notify_one();
+
+      to_serial params(tag_requests ? '#' + std::to_string(id) + ' ' + _fun_id : _fun_id);
+      params.insert(data);
+      send_fun(params.serial());
+    }
+    template<typename ... TArgs>
+    std::future<result> call_async(unsigned long _timeout_ms, const string& _fun_id, TArgs&& ... _args) {
+      auto done = std::make_shared<std::promise<result>>();
+      auto f = done->get_future();
+      call_async([done](std::exception_ptr _err, const result& _res) {
+        if (_err) done->set_exception(_err);
+        else done->set_value(_res);
+      }, _timeout_ms, _fun_id, std::forward<TArgs>(_args) ...);
+      return f;
+    }
+    /*
+     * Returns false if _response isn't an answer to a call in flight (late, already timed out, or untagged with
+     * nothing in flight)
+     */
+    bool on_response(const string& _response) {
+      if (_response.empty()) return false;
+      const bool tagged = _response[0] == '#';
+      const auto sp = tagged ? _response.find(' ') : string::npos;
+      uint64_t id = 0;
+      if (tagged) {
+        try {
+          id = std::stoull(_response.substr(1, sp - 1));
+        }
+        catch (std::exception&) {
+          return false;
+        }
+      }
+      callback_f cb;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Ids only go up, so the first pending call is the oldest
+        auto it = tagged ? pending.find(id) : pending.begin();
+        if (it == pending.end()) return false;
+        cb = std::move(it->second.callback);
+        pending.erase(it);
+      }
+      std::shared_ptr<from_serial> rp(new from_serial(!tagged ? _response : sp == string::npos ? string() : _response.substr(sp + 1)));
+      if (rp->prefix_str == "PRPC_GOOD") cb(nullptr, result(rp));
+      else if (rp->prefix_str == "PRPC_INV_FUN_NOEXIST") cb(std::make_exception_ptr(UnknownFunctionException()), result());
+      else if (rp->prefix_str == "PRPC_INV_ARG_EXTRACT_FAILED") cb(std::make_exception_ptr(BadArgListException()), result());
+      else cb(std::make_exception_ptr(UnknownInvokerException()), result());
+      return true;
+    }
+    size_t in_flight() {
+      std::lock_guard<std::mutex> lock(mutex);
+      return pending.size();
+    }
+
+   private:
+    struct pending_call {
+      callback_f callback;
+      std::chrono::steady_clock::time_point deadline;
+    };
+    transport_send_f send_fun;
+    bool tag_requests;
+    std::mutex mutex;
+    std::condition_variable cv;
+    map<uint64_t, pending_call> pending;
+    uint64_t last_id = 0;
+    bool running = true;
+    std::thread timeout_thread;
+
+    void expire_loop() {
+      std::unique_lock<std::mutex> lock(mutex);
+      vector<callback_f> expired;
+      while (running) {
+        const auto now = std::chrono::steady_clock::now();
+        auto wake = now + std::chrono::seconds(1);
+        for (auto it = pending.begin(); it != pending.end();) {
+          if (it->second.deadline <= now) {
+            expired.push_back(std::move(it->second.callback));
+            it = pending.erase(it);
+          }
+          else {
+            wake = std::min(wake, it->second.deadline);
+            ++it;
+          }
+        }
+        if (!expired.empty()) {
+          lock.unlock();
+          for (auto& cb: expired) cb(std::make_exception_ptr(TimeoutException()), result());
+          expired.clear();
+          lock.lock();
+          continue;
+        }
+        cv.wait_until(lock, wake);
+      }
+    }
+  };
 }
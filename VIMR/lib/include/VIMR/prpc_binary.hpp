@@ -0,0 +1,225 @@
+// Binary mode for prpc (prpc.hpp), for calls that have to be cheap, e.g. live controls.
+//
+// Functions are registered with small integer ids and dispatched through a flat table, arguments are packed
+// little endian into a VIMR buffer (e.g. ShortSerialMessage). Once registered, a call doesn't allocate unless it
+// has string arguments or throws.
+//
+// Request:  [uint8 request_tag][uint16 fun_id][uint32 call_id][args...]
+// Response: [uint8 response_tag][uint32 call_id][uint8 status][return value, or an error string]
+// call_id 0 means no response is wanted. The tags can't start a text mode message, so both modes can share a
+// transport (see binary_invoker::is_request()).
+
+#pragma once
+#include <tuple>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <exception>
+#include <functional>
+#include <type_traits>
+#include "prpc.hpp"
+#include "serialbuffer.hpp"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "prpc binary mode packs values in host byte order, which has to be little endian"
+#endif
+
+namespace prpc {
+  namespace binary {
+    static constexpr uint8_t request_tag = 0xB1;
+    static constexpr uint8_t response_tag = 0xB2;
+
+    enum class status : uint8_t {
+      good, no_function, bad_args, exception
+    };
+
+    template<typename>
+    struct function_signature;
+    template<typename R, typename ... T>
+    struct function_signature<std::function<R(T ...)>> {
+      using ret_t = std::decay_t<R>;
+      using args_tupl_t = std::tuple<std::decay_t<T> ...>;
+    };
+
+    template<typename T>
+    std::enable_if_t<std::is_trivially_copyable_v<T>, bool>
+    put_value(VIMR::BufWriter* _dst, const T& _value) {
+      return _dst->put(_value);
+    }
+    inline bool put_value(VIMR::BufWriter* _dst, const std::string& _value) {
+      if (_value.size() > UINT16_MAX) return false;
+      return _dst->put(static_cast<uint16_t>(_value.size())) && _dst->put(_value.data(), _value.size());
+    }
+    inline bool put_value(VIMR::BufWriter* _dst, const char* _value) {
+      return put_value(_dst, std::string(_value));
+    }
+    template<typename T>
+    std::enable_if_t<std::is_trivially_copyable_v<T>, bool>
+    get_value(VIMR::BufReader* _src, T& _value) {
+      return _src->pop(_value);
+    }
+    inline bool get_value(VIMR::BufReader* _src, std::string& _value) {
+      uint16_t n;
+      if (!_src->pop(n) || _src->read_headroom() < n) return false;
+      _value.resize(n);
+      return _src->pop(_value.data(), n);
+    }
+    template<typename ... T, std::size_t ... I>
+    bool get_tuple(VIMR::BufReader* _src, std::tuple<T ...>& _tuple, std::index_sequence<I ...>) {
+      return (get_value(_src, std::get<I>(_tuple)) && ...);
+    }
+  }
+
+  /*
+   * Receiving end of binary mode, next to (not instead of) a text mode invoker
+   */
+  class binary_invoker {
+    using wrapped_f = function<binary::status(VIMR::BufReader*, VIMR::BufWriter*)>;
+    vector<wrapped_f> functions;
+   public:
+    /*
+     * Ids index a table, so keep them small. Throws if _fun_id is taken.
+     */
+    template<typename FUN_T>
+    void add(uint16_t _fun_id, FUN_T _fun) {
+      if (_fun_id < functions.size() && functions[_fun_id]) throw std::exception();
+      if (_fun_id >= functions.size()) functions.resize(_fun_id + 1);
+
+      functions[_fun_id] = [fun = std::function{ std::move(_fun) }](VIMR::BufReader* _args, VIMR::BufWriter* _ret) {
+        using function_signature = binary::function_signature<std::decay_t<decltype(fun)>>;
+        using args_tupl_t = typename function_signature::args_tupl_t;
+
+        args_tupl_t args;
+        if (!binary::get_tuple(_args, args, std::make_index_sequence<std::tuple_size_v<args_tupl_t>>{}) || _args->read_headroom() != 0) {
+          return binary::status::bad_args;
+        }
+        if constexpr (std::is_void_v<typename function_signature::ret_t>) {
+          std::apply(fun, std::move(args));
+        }
+        else {
+          if (!binary::put_value(_ret, std::apply(fun, std::move(args)))) throw std::exception();
+        }
+        return binary::status::good;
+      };
+    }
+    static bool is_request(const VIMR::BufReader* _msg) {
+      uint8_t tag;
+      return _msg->peek(tag) && tag == binary::request_tag;
+    }
+    /*
+     * Calls the function _req asks for. Returns true if a response was written to _resp (after resetting it),
+     * false if the caller doesn't want one or _req isn't a binary request.
+     */
+    template<class BUF_T>
+    bool invoke(VIMR::BufReader* _req, BUF_T* _resp) {
+      uint8_t tag;
+      uint16_t fun_id;
+      uint32_t call_id;
+      if (!_req->pop(tag) || tag != binary::request_tag || !_req->pop(fun_id) || !_req->pop(call_id)) return false;
+
+      _resp->reset();
+      _resp->put(binary::response_tag);
+      _resp->put(call_id);
+      auto st = binary::status::no_function;
+      string what;
+      if (fun_id < functions.size() && functions[fun_id]) {
+        _resp->put(binary::status::good);
+        try {
+          st = functions[fun_id](_req, _resp);
+        }
+        catch (std::exception& e) {
+          st = binary::status::exception;
+          what = e.what();
+        }
+      }
+      if (st != binary::status::good) {
+        // Drop whatever the function got to write
+        _resp->reset();
+        _resp->put(binary::response_tag);
+        _resp->put(call_id);
+        _resp->put(st);
+        if (st == binary::status::exception) binary::put_value(_resp, what);
+      }
+      return call_id != 0;
+    }
+  };
+
+  /*
+   * Calling end of binary mode. BUF_T (e.g. VIMR::ShortSerialMessage) holds requests and responses, one of each
+   * is kept so calls don't allocate. Not thread safe.
+   */
+  template<class BUF_T>
+  class binary_caller {
+   public:
+    // Sends a request
+    using send_f = function<bool(VIMR::BufReader* _req)>;
+    // Sends a request and waits for its response, false if none came
+    using sendrec_f = function<bool(VIMR::BufReader* _req, BUF_T* _resp)>;
+
+    binary_caller(send_f _send_fun, sendrec_f _sendrec_fun = nullptr) : send_fun(std::move(_send_fun)), sendrec_fun(std::move(_sendrec_fun)) {}
+
+    /*
+     * Fire and forget, no response
+     */
+    template<typename ... TArgs>
+    bool post(uint16_t _fun_id, const TArgs& ... _args) {
+      return pack(&request, _fun_id, 0, _args ...) && send_fun(&request);
+    }
+    /*
+     * Waits for the response and returns its value. Throws like caller::call(), and TimeoutException if no
+     * response came.
+     */
+    template<typename RET_T = void, typename ... TArgs>
+    RET_T call(uint16_t _fun_id, const TArgs& ... _args) {
+      if (++last_call_id == 0) ++last_call_id;
+      if (!sendrec_fun || !pack(&request, _fun_id, last_call_id, _args ...)) throw BadArgListException();
+      if (!sendrec_fun(&request, &response)) throw TimeoutException();
+      return unpack<RET_T>(&response, last_call_id);
+    }
+
+    template<typename ... TArgs>
+    static bool pack(BUF_T* _dst, uint16_t _fun_id, uint32_t _call_id, const TArgs& ... _args) {
+      _dst->reset();
+      return _dst->put(binary::request_tag) && _dst->put(_fun_id) && _dst->put(_call_id) && (binary::put_value(_dst, _args) && ...);
+    }
+    /*
+     * The call id of a response, to match it to its call
+     */
+    static bool peek_call_id(const VIMR::BufReader* _resp, uint32_t* _call_id) {
+      char header[sizeof(uint8_t) + sizeof(uint32_t)];
+      if (!_resp->peek(header, sizeof(header)) || static_cast<uint8_t>(header[0]) != binary::response_tag) return false;
+      memcpy(_call_id, header + 1, sizeof(*_call_id));
+      return true;
+    }
+    /*
+     * The return value of the response to call _call_id; throws if the call failed
+     */
+    template<typename RET_T>
+    static RET_T unpack(VIMR::BufReader* _resp, uint32_t _call_id) {
+      uint8_t tag;
+      uint32_t call_id;
+      binary::status st;
+      _resp->seekstart();
+      if (!_resp->pop(tag) || tag != binary::response_tag || !_resp->pop(call_id) || call_id != _call_id || !_resp->pop(st)) {
+        throw UnknownInvokerException();
+      }
+      if (st == binary::status::no_function) throw UnknownFunctionException();
+      if (st == binary::status::bad_args) throw BadArgListException();
+      if (st != binary::status::good) throw UnknownInvokerException();
+      if constexpr (!std::is_void_v<RET_T>) {
+        std::decay_t<RET_T> v{};
+        if (!binary::get_value(_resp, v)) throw UnknownInvokerException();
+        return v;
+      }
+    }
+
+   private:
+    send_f send_fun;
+    sendrec_f sendrec_fun;
+    BUF_T request;
+    BUF_T response;
+    uint32_t last_call_id = 0;
+  };
+}
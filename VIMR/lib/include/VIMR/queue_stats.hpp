@@ -0,0 +1,127 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+
+namespace VIMR {
+  /*
+   * Counters for one RingBuffer/BufferProcessor, enabled with enable_stats(name).
+   *
+   * Every counter is a relaxed atomic which is only ever incremented, so the producer and consumer never
+   * contend on anything other than the cache lines these live on. Times are only measured when a call
+   * actually has to wait, or around the process function of a BufferProcessor (per item, or per batch for
+   * batched processors).
+   */
+  struct QueueStats {
+    static constexpr size_t n_occupancy_bins = 8;
+
+    /*
+     * Plain copy of the counters at one point in time
+     */
+    struct Snapshot {
+      std::string name;
+      size_t capacity{};
+      uint64_t n_in{};
+      uint64_t n_out{};
+      uint64_t n_dropped{};
+      uint64_t occupancy[n_occupancy_bins]{};
+      uint64_t producer_blocked_ns{};
+      uint64_t consumer_idle_ns{};
+      uint64_t processing_ns{};
+      uint64_t processing_max_ns{};
+    };
+
+    QueueStats(std::string _name, size_t _capacity) : name(std::move(_name)), capacity(_capacity) {}
+
+    const std::string name;
+    const size_t capacity;
+    alignas(64) std::atomic<uint64_t> n_in{ 0 };
+    std::atomic<uint64_t> n_dropped{ 0 };
+    std::atomic<uint64_t> producer_blocked_ns{ 0 };
+    // Occupancy (num_used/capacity) sampled on every head advance, in n_occupancy_bins equal bins
+    std::atomic<uint64_t> occupancy[n_occupancy_bins]{};
+    alignas(64) std::atomic<uint64_t> n_out{ 0 };
+    std::atomic<uint64_t> consumer_idle_ns{ 0 };
+    std::atomic<uint64_t> processing_ns{ 0 };
+    std::atomic<uint64_t> processing_max_ns{ 0 };
+
+    static uint64_t now_ns() {
+      return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    void on_in(size_t _num_used) {
+      n_in.fetch_add(1, std::memory_order_relaxed);
+      const size_t bin = std::min(n_occupancy_bins - 1, (_num_used * n_occupancy_bins) / std::max<size_t>(capacity, 1));
+      occupancy[bin].fetch_add(1, std::memory_order_relaxed);
+    }
+    void on_out(uint64_t _n = 1) {
+      n_out.fetch_add(_n, std::memory_order_relaxed);
+    }
+    void on_drop() {
+      n_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    void on_blocked(uint64_t _ns) {
+      producer_blocked_ns.fetch_add(_ns, std::memory_order_relaxed);
+    }
+    void on_idle(uint64_t _ns) {
+      consumer_idle_ns.fetch_add(_ns, std::memory_order_relaxed);
+    }
+    void on_processed(uint64_t _ns) {
+      processing_ns.fetch_add(_ns, std::memory_order_relaxed);
+      // Only the consumer thread writes this, so load+store is enough
+      if (_ns > processing_max_ns.load(std::memory_order_relaxed)) processing_max_ns.store(_ns, std::memory_order_relaxed);
+    }
+
+    Snapshot snapshot() const {
+      Snapshot s;
+      s.name = name;
+      s.capacity = capacity;
+      s.n_in = n_in.load(std::memory_order_relaxed);
+      s.n_out = n_out.load(std::memory_order_relaxed);
+      s.n_dropped = n_dropped.load(std::memory_order_relaxed);
+      for (size_t i = 0; i < n_occupancy_bins; i++) s.occupancy[i] = occupancy[i].load(std::memory_order_relaxed);
+      s.producer_blocked_ns = producer_blocked_ns.load(std::memory_order_relaxed);
+      s.consumer_idle_ns = consumer_idle_ns.load(std::memory_order_relaxed);
+      s.processing_ns = processing_ns.load(std::memory_order_relaxed);
+      s.processing_max_ns = processing_max_ns.load(std::memory_order_relaxed);
+      return s;
+    }
+  };
+
+  /*
+   * Process-wide list of every QueueStats which is currently enabled.
+   * The mutex is only taken when a queue is (un)registered or a snapshot is taken, never per item.
+   */
+  class QueueStatsRegistry {
+   public:
+    static void add(QueueStats* _s) {
+      std::lock_guard<std::mutex> lock(instance().mutex);
+      instance().stats.push_back(_s);
+    }
+    static void remove(QueueStats* _s) {
+      std::lock_guard<std::mutex> lock(instance().mutex);
+      auto& v = instance().stats;
+      v.erase(std::remove(v.begin(), v.end(), _s), v.end());
+    }
+    static std::vector<QueueStats::Snapshot> snapshot() {
+      std::lock_guard<std::mutex> lock(instance().mutex);
+      std::vector<QueueStats::Snapshot> res;
+      res.reserve(instance().stats.size());
+      for (const auto* s: instance().stats) res.push_back(s->snapshot());
+      return res;
+    }
+   private:
+    std::mutex mutex;
+    std::vector<QueueStats*> stats;
+    static QueueStatsRegistry& instance() {
+      static QueueStatsRegistry r;
+      return r;
+    }
+  };
+}
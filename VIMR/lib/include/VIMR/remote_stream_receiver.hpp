@@ -4,9 +4,18 @@
 #include "netstream.hpp"
 #include "config.hpp"
 #include "async.hpp"
+#include "side_table.hpp"
 
 namespace VIMR
 {
+  /*
+   * VoxStreamReceiver's state beyond the members the prebuilt library constructs (see SideTable)
+   */
+  struct VoxStreamReceiverExtras
+  {
+    Network::LatencyStats latency;
+  };
+
   class VoxStreamReceiver
   {
     Network::VNetStream<SerialMessage>* receiver{};
@@ -16,11 +25,48 @@ namespace VIMR
     ConfigFile config;
   public:
     VoxStreamReceiver();
+    ~VoxStreamReceiver() {
+      SideTable<VoxStreamReceiverExtras>::erase(this, deserializer);
+    }
     bool init(const char* _inst_config_file);
     bool init_vnet_stream(const char* _owner_inst_id, const char* _inst_id, const char* _vnet_addr, bool _is_lan);
 
     int get_instance_id(char** id_out);
 
     bool set_vox_sink(const VoxelCallback& _callback);
+
+    /*
+     * Capture to display latency: sync to the sender's clock every _interval_ms (call after init_vnet_stream()),
+     * then call frame_latency_ms() for every frame shown
+     */
+    bool enable_clock_sync(unsigned long _interval_ms = 1000) {
+      if (!receiver) return false;
+      receiver->enable_clock_sync(_interval_ms);
+      return true;
+    }
+    /*
+     * From _v's capture to now, also added to latency(). False until the clocks are synced or if the sender doesn't
+     * send capture times (see MultiStream::send_capture_time()).
+     */
+    bool frame_latency_ms(const VoxelMessage* _v, double* _ms_out) {
+      if (!receiver || !deserializer || !receiver->frame_latency_ms(_v->frame_number, _ms_out)) return false;
+      extras()->latency.add(*_ms_out);
+      return true;
+    }
+    /*
+     * Every frame_latency_ms() so far. Call after init().
+     */
+    const Network::LatencyStats& latency() {
+      return extras()->latency;
+    }
+
+  private:
+    /*
+     * Keyed by deserializer, which init() allocates and nothing frees
+     */
+    VoxStreamReceiverExtras* extras() {
+      if (auto* x = SideTable<VoxStreamReceiverExtras>::find(this, deserializer)) return x;
+      return SideTable<VoxStreamReceiverExtras>::get(this, deserializer);
+    }
   };
 }
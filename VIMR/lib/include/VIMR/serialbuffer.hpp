@@ -4,12 +4,14 @@
 #include<fstream>
 #include <vector>
 #include <algorithm>
+#include <utility>
 #include "serialbuffer.hpp"
 
 namespace VIMR {
   class BufBase {
     template<size_t INIT_CAP, size_t MAX_CAP, size_t GROW_MARGIN>
     friend class SerialBuffer;
+    friend class BufView;
     char* data_read_ptr{};
     char* data_write_ptr{};
     char* data_start_ptr{};
@@ -132,6 +134,31 @@ namespace VIMR {
       data_write_ptr += _n;
       return true;
     }
+    /*
+     * Writes _n bytes at _offset from the start of the buffer (not the write position), growing the buffer if needed.
+     * The write position moves to the end of the written range if that is past it. Bytes between the old write
+     * position and _offset are left uninitialised.
+     */
+    bool put_at(size_t _offset, const char* _d, size_t _n) {
+      const size_t required_cap = _offset + _n;
+      if (required_cap >= MAX_CAP) return false;
+      if (required_cap > capacity()) {
+        if (!GROW_MARGIN) return false;
+        if (!try_realloc(std::min(MAX_CAP, required_cap + GROW_MARGIN))) return false;
+      }
+      memcpy(data_start_ptr + _offset, _d, _n);
+      data_write_ptr = std::max(data_write_ptr, data_start_ptr + required_cap);
+      return true;
+    }
+    /*
+     * Exchanges the contents (and capacity) of two buffers without copying
+     */
+    void swap(SerialBuffer& _other) noexcept {
+      std::swap(data_read_ptr, _other.data_read_ptr);
+      std::swap(data_write_ptr, _other.data_write_ptr);
+      std::swap(data_start_ptr, _other.data_start_ptr);
+      std::swap(data_end_ptr, _other.data_end_ptr);
+    }
     bool put(std::fstream& _strm, size_t _n) override {
       if (!_strm.good()) return false;
       if (!try_ensure_capacity(_n)) return false;
@@ -186,4 +213,63 @@ namespace VIMR {
       return put(reinterpret_cast<const char*>(&_d), sizeof(_d));
     }
   };
+
+  /*
+   * Read-only BufReader over memory owned by someone else (e.g. one datagram in a FragmentSet).
+   * The memory has to outlive the view.
+   */
+  class BufView : public BufReader {
+   public:
+    BufView() = default;
+    BufView(const char* _d, size_t _n) {
+      reset(_d, _n);
+    }
+    void reset(const char* _d, size_t _n) {
+      data_start_ptr = const_cast<char*>(_d);
+      data_read_ptr = data_start_ptr;
+      data_write_ptr = data_start_ptr + _n;
+      data_end_ptr = data_write_ptr;
+    }
+    size_t size() const override {
+      return data_write_ptr - data_start_ptr;
+    }
+    size_t capacity() const override {
+      return size();
+    }
+    const char* read_ptr() const override {
+      return data_read_ptr;
+    }
+    void seekstart() override {
+      data_read_ptr = data_start_ptr;
+    }
+    size_t read_headroom() const override {
+      return data_write_ptr - data_read_ptr;
+    }
+    bool peek(char* _d, size_t _n) const override {
+      if (read_headroom() < _n) return false;
+      memcpy(_d, data_read_ptr, _n);
+      return true;
+    }
+    bool pop(char* _d, size_t _n) override {
+      if (!peek(_d, _n)) return false;
+      data_read_ptr += _n;
+      return true;
+    }
+    bool pop(std::fstream& _strm, size_t _n) override {
+      if (!_strm.good() || read_headroom() < _n) return false;
+      _strm.write(data_read_ptr, static_cast<std::streamsize>(_n));
+      return _strm.good();
+    }
+    bool dump(std::fstream& _strm) override {
+      seekstart();
+      uint64_t n_bytes = read_headroom();
+      if(!n_bytes) return false;
+      _strm.write(reinterpret_cast<const char*>(&n_bytes), sizeof(n_bytes));
+      return pop(_strm, n_bytes);
+    }
+    template<typename T>
+    bool pop(T& _d) {
+      return pop(reinterpret_cast<char*>(&_d), sizeof(_d));
+    }
+  };
 }
\ No newline at end of file
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <unordered_map>
+
+namespace VIMR {
+  /*
+   * Per-object state for classes whose layout is fixed by the prebuilt library (e.g. anything embedded in
+   * Component), so that new state can't be added as members.
+   *
+   * Entries are keyed by the object's address plus an instance key, which has to differ between two objects that
+   * live at the same address one after the other (e.g. a buffer the object allocates and never frees). Destructors
+   * compiled into the library don't erase their entries, so a lookup whose instance key doesn't match finds
+   * nothing and the next insert() replaces the stale entry.
+   *
+   * find() is meant for hot paths. Entries are counted per hash bucket of the object address, so for an object
+   * without an entry (e.g. a buffer without stats) it is usually one atomic load, even while other objects have
+   * entries. An object with an entry is usually a hit in a small per-thread cache, and only a cache miss takes the
+   * mutex. A pointer returned by find() or get() stays valid until the entry is erased or replaced, which must only
+   * happen once no other thread uses the object.
+   */
+  template<class STATE_T>
+  class SideTable {
+   public:
+    /*
+     * nullptr if nothing was inserted for this instance of _obj
+     */
+    static STATE_T* find(const void* _obj, const void* _instance) {
+      auto& tbl = table();
+      const size_t h = hash(_obj);
+      if (tbl.n_in_bucket[h % n_buckets].load(std::memory_order_acquire) == 0) return nullptr;
+      auto& c = cache[h % n_cached];
+      if (c.epoch == tbl.epoch.load(std::memory_order_acquire) && c.obj == _obj && c.instance == _instance) return c.state;
+
+      std::lock_guard<std::mutex> lock(tbl.mutex);
+      auto it = tbl.entries.find(_obj);
+      STATE_T* s = (it != tbl.entries.end() && it->second.instance == _instance) ? it->second.state.get() : nullptr;
+      c = { tbl.epoch.load(std::memory_order_relaxed), _obj, _instance, s };
+      return s;
+    }
+    /*
+     * The state of this instance of _obj, default constructed (replacing any stale entry) if there is none yet
+     */
+    static STATE_T* get(const void* _obj, const void* _instance) {
+      std::unique_ptr<STATE_T> stale;
+      auto& tbl = table();
+      std::lock_guard<std::mutex> lock(tbl.mutex);
+      auto& e = tbl.entries[_obj];
+      if (e.state && e.instance == _instance) return e.state.get();
+      if (!e.state) tbl.n_in_bucket[hash(_obj) % n_buckets].fetch_add(1, std::memory_order_release);
+      stale = std::move(e.state);
+      e.instance = _instance;
+      e.state.reset(new STATE_T());
+      changed(tbl);
+      return e.state.get();
+    }
+    /*
+     * Call from the destructor of _obj, once no other thread uses it
+     */
+    static void erase(const void* _obj, const void* _instance) {
+      std::unique_ptr<STATE_T> state;
+      auto& tbl = table();
+      if (tbl.n_in_bucket[hash(_obj) % n_buckets].load(std::memory_order_acquire) == 0) return;
+      std::lock_guard<std::mutex> lock(tbl.mutex);
+      auto it = tbl.entries.find(_obj);
+      if (it == tbl.entries.end() || it->second.instance != _instance) return;
+      state = std::move(it->second.state);
+      tbl.entries.erase(it);
+      tbl.n_in_bucket[hash(_obj) % n_buckets].fetch_sub(1, std::memory_order_release);
+      changed(tbl);
+    }
+
+   private:
+    static constexpr size_t n_cached = 16;
+    static constexpr size_t n_buckets = 256;
+    struct Entry {
+      const void* instance{};
+      std::unique_ptr<STATE_T> state;
+    };
+    struct Table {
+      std::mutex mutex;
+      std::unordered_map<const void*, Entry> entries;
+      // Number of entries per hash bucket, so that find() can skip the cache and the mutex for most objects without one
+      std::atomic<uint32_t> n_in_bucket[n_buckets]{};
+      // Bumped on every change, so that cached lookups from before the change miss
+      std::atomic<uint64_t> epoch{ 1 };
+    };
+    struct Cached {
+      uint64_t epoch{};
+      const void* obj{};
+      const void* instance{};
+      STATE_T* state{};
+    };
+    static inline thread_local Cached cache[n_cached]{};
+
+    static void changed(Table& _tbl) {
+      _tbl.epoch.fetch_add(1, std::memory_order_acq_rel);
+    }
+    static size_t hash(const void* _obj) {
+      // Fibonacci hashing of the address without its low bits, which differ little between heap objects
+      return static_cast<size_t>(((reinterpret_cast<uintptr_t>(_obj) >> 4) * 0x9E3779B97F4A7C15ull) >> 40);
+    }
+    static Table& table() {
+      // Never destroyed, objects with static storage may still use it at exit
+      static Table* tbl = new Table();
+      return *tbl;
+    }
+  };
+}
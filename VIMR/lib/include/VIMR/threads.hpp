@@ -0,0 +1,104 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include "async.hpp"
+#include "async_log.hpp"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace VIMR {
+  /*
+   * Name, CPU cores and scheduling priority for one pipeline thread.
+   *
+   * E.g. AVideoActor (VIMRUE5 plugin) applies its PlayThread and LoadThread settings to each VoxVidPlayer's threads.
+   *
+   * Priority is relative to normal: -2 (idle) .. 0 (normal, the default) .. 2 (time critical).
+   * On Linux, priorities above 0 use SCHED_FIFO which needs CAP_SYS_NICE, otherwise a warning is logged
+   * and the thread keeps its current priority.
+   */
+  struct ThreadConfig {
+    std::string name{};
+    std::vector<int> cores{};
+    int priority = 0;
+
+    bool empty() const {
+      return name.empty() && cores.empty() && priority == 0;
+    }
+  };
+
+  /*
+   * Apply _tc to a running thread. Returns false (and logs a warning) if any part of it couldn't be applied.
+   */
+  inline bool apply_thread_config(std::thread& _t, const ThreadConfig& _tc) {
+    if (!_t.joinable() || _tc.empty()) return true;
+    bool ok = true;
+    const auto h = _t.native_handle();
+#ifdef _WIN32
+    if (!_tc.name.empty()) {
+      const std::wstring wname(_tc.name.begin(), _tc.name.end());
+      SetThreadDescription(h, wname.c_str());
+    }
+    if (!_tc.cores.empty()) {
+      DWORD_PTR mask = 0;
+      for (const auto c: _tc.cores) if (c >= 0 && c < static_cast<int>(8 * sizeof(DWORD_PTR))) mask |= DWORD_PTR(1) << c;
+      if (!mask || !SetThreadAffinityMask(h, mask)) {
+        log(LogLvl::Warn, "Threads", "%s failed to set core affinity", _tc.name.c_str());
+        ok = false;
+      }
+    }
+    static const int win_priority[5] = { THREAD_PRIORITY_IDLE, THREAD_PRIORITY_BELOW_NORMAL, THREAD_PRIORITY_NORMAL, THREAD_PRIORITY_ABOVE_NORMAL, THREAD_PRIORITY_TIME_CRITICAL };
+    const int p = std::clamp(_tc.priority, -2, 2);
+    if (!SetThreadPriority(h, win_priority[p + 2])) {
+      log(LogLvl::Warn, "Threads", "%s failed to set priority %i", _tc.name.c_str(), p);
+      ok = false;
+    }
+#else
+    if (!_tc.name.empty()) {
+      // Linux thread names are limited to 15 characters
+      pthread_setname_np(h, _tc.name.substr(0, 15).c_str());
+    }
+    if (!_tc.cores.empty()) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (const auto c: _tc.cores) if (c >= 0 && c < CPU_SETSIZE) CPU_SET(c, &set);
+      if (pthread_setaffinity_np(h, sizeof(set), &set) != 0) {
+        log(LogLvl::Warn, "Threads", "%s failed to set core affinity", _tc.name.c_str());
+        ok = false;
+      }
+    }
+    const int p = std::clamp(_tc.priority, -2, 2);
+    sched_param sp{};
+    int policy = SCHED_OTHER;
+    if (p == -2) policy = SCHED_IDLE;
+    else if (p == -1) policy = SCHED_BATCH;
+    else if (p > 0) {
+      policy = SCHED_FIFO;
+      sp.sched_priority = (p == 1) ? sched_get_priority_min(SCHED_FIFO) : sched_get_priority_max(SCHED_FIFO) / 2;
+    }
+    if (pthread_setschedparam(h, policy, &sp) != 0) {
+      log(LogLvl::Warn, "Threads", "%s failed to set priority %i", _tc.name.c_str(), p);
+      ok = false;
+    }
+#endif
+    return ok;
+  }
+
+  /*
+   * Apply _tc to the consumer thread of a BufferProcessor (no-op for executor-driven processors)
+   */
+  template<class T, class RING_T>
+  bool apply_thread_config(BufferProcessor<T, RING_T>& _bp, const ThreadConfig& _tc) {
+    return apply_thread_config(_bp.processing_thread(), _tc);
+  }
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "prpc.hpp"
+#include "prpc_binary.hpp"
 #include "async.hpp"
 #include "async_log.hpp"
 #include "json.hpp"
@@ -14,6 +15,21 @@ namespace VIMR {
     enum class RPCTarget {
       Broadcast, Direct, BroadCastAttn, DirectAttn
     };
+    /*
+     * Function ids of binary RPC (see RPCInvoker::add_binary()), shared by every component so that one caller can
+     * talk to any of them
+     */
+    enum class BinaryRPC : uint16_t {
+      SendRateMbps = 1
+    };
+    /*
+     * RPCInvoker's binary mode (see RPCInvoker::add_binary()). Component's rpc is built by the prebuilt library,
+     * so this lives in a SideTable instead of in RPCInvoker.
+     */
+    struct RPCInvokerBinary {
+      prpc::binary_invoker invoker;
+      ShortSerialMessage response;
+    };
     class RPCInvoker : BufferProcessor<ShortSerialMessage> {
       VNetStream<ShortSerialMessage>* cmd_stream;
       prpc::invoker* invoker;
@@ -25,6 +41,11 @@ namespace VIMR {
         cmd_stream->send(&b);
       }
       void parse_and_invoke_cmdmsg(ShortSerialMessage* _b) {
+        if (prpc::binary_invoker::is_request(_b)) {
+          auto* b = binary();
+          if (b->invoker.invoke(_b, &b->response)) cmd_stream->send(&b->response);
+          return;
+        }
         //on_receiving a response with the invoke return/error/exception code
         auto nbytes = _b->read_headroom();
         _b->pop(tmp_cmd_buf, nbytes);
@@ -32,7 +53,14 @@ namespace VIMR {
         invoker->invoke(tmp_cmd_buf);
       }
       string pingstr;
+      RPCInvokerBinary* binary() {
+        if (auto* b = SideTable<RPCInvokerBinary>::find(this, instance_key())) return b;
+        return SideTable<RPCInvokerBinary>::get(this, instance_key());
+      }
      public:
+      /*
+       * Commands run on the invoker's own thread rather than Executor::shared(), since handlers may block
+       */
       RPCInvoker(const char* _id, const char* _peer, const char* _vnet_addr) : BufferProcessor<ShortSerialMessage>(32, [this](ShortSerialMessage* _msg) { parse_and_invoke_cmdmsg(_msg);}) {
         id = string(_id);
         pingstr = R"({"tgt": ")" + id + R"(", "cmd": "ping", "t": "signal", "noui": true})";
@@ -40,8 +68,10 @@ namespace VIMR {
         cmd_stream = new VNetStream(_vnet_addr, _id, _peer, false, this, 2000, -1);
       }
       ~RPCInvoker() {
+        this->release();
         delete cmd_stream;
         delete invoker;
+        SideTable<RPCInvokerBinary>::erase(this, instance_key());
       }
       template<typename VAL_T, typename FUN_T>
       bool add_setter(const string& _cmd_name, const VAL_T _default, vector<VAL_T> _range_or_options, RPCTarget _broadcast, FUN_T _f) {
@@ -74,13 +104,85 @@ namespace VIMR {
         string argspec = cmdjson.dump();
         invoker->add(_cmd_name, argspec, _f);
       }
+      /*
+       * Binary mode call of _f (see prpc_binary.hpp), for live controls which have to apply without parsing text.
+       * Independent of the text mode commands, so a control which the web UI also needs is added both ways.
+       * Binary requests are only answered by invokers built from these headers.
+       */
+      template<typename FUN_T>
+      void add_binary(BinaryRPC _fun_id, FUN_T _f) {
+        binary()->invoker.add(static_cast<uint16_t>(_fun_id), _f);
+      }
       template<typename FUN_T>
       void add_toggle(const string& _cmd_name, bool _default, FUN_T _f) {
         add_toggle(_cmd_name, _default, RPCTarget::Direct, "", _f);
       }
+      /*
+       * Adds a "SendRateMbps" slider which sets the per-peer send rate of _strm while it's running, also as
+       * BinaryRPC::SendRateMbps. 0 restores the default rate (see MessageFragmenter).
+       */
+      template<typename SERIAL_T>
+      bool add_send_rate_setter(MultiStream<SERIAL_T>* _strm, const string& _cmd_name = "SendRateMbps", double _default_mbps = 0, double _max_mbps = 1000, RPCTarget _broadcast = RPCTarget::Direct) {
+        const auto set_rate = [_strm](double _mbps) {
+          _strm->set_send_rate(_mbps > 0 ? _mbps * 1e6 / 8 : -1);
+        };
+        add_binary(BinaryRPC::SendRateMbps, set_rate);
+        return add_setter<double>(_cmd_name, _default_mbps, { 0.0, _max_mbps }, _broadcast, set_rate);
+      }
       void add_ping(const std::function<string(void)>& _v) {
         invoker->add("ping", pingstr, _v);
       }
     };
+
+    /*
+     * Calls the commands of one component's RPCInvoker without waiting for each answer (see prpc::async_caller),
+     * so a setting can go out to many components in one round trip
+     */
+    class RPCCaller : BufferProcessor<ShortSerialMessage> {
+      VNetStream<ShortSerialMessage>* cmd_stream;
+      prpc::async_caller* caller;
+      char* tmp_rsp_buf = new char[1025]{};
+      void send(const string& _msg) {
+        ShortSerialMessage b;
+        if (!b.put(_msg.c_str(), _msg.size())) {
+          log(LogLvl::Warn, "RPC", "call of %zu bytes is too long for a command message", _msg.size());
+          return;
+        }
+        cmd_stream->send(&b);
+      }
+      void parse_response(ShortSerialMessage* _b) {
+        auto nbytes = _b->read_headroom();
+        _b->pop(tmp_rsp_buf, nbytes);
+        tmp_rsp_buf[nbytes] = 0;
+        caller->on_response(tmp_rsp_buf);
+      }
+     public:
+      /*
+       * Responses, and the call_async() callbacks they complete, are handled on the caller's own thread
+       * rather than Executor::shared(), since callbacks may block.
+       * _tag_requests false for components running a library without request tags (see prpc::async_caller)
+       */
+      RPCCaller(const char* _id, const char* _peer, const char* _vnet_addr, bool _tag_requests = true) : BufferProcessor<ShortSerialMessage>(32, [this](ShortSerialMessage* _msg) { parse_response(_msg);}) {
+        caller = new prpc::async_caller([this](const string& _req) { send(_req); }, _tag_requests);
+        cmd_stream = new VNetStream(_vnet_addr, _id, _peer, false, this, 2000, -1);
+      }
+      ~RPCCaller() {
+        this->release();
+        delete cmd_stream;
+        delete caller;
+        delete[] tmp_rsp_buf;
+      }
+      /*
+       * The future throws prpc::TimeoutException if there is no answer within _timeout_ms
+       */
+      template<typename ... TArgs>
+      std::future<prpc::async_caller::result> call_async(unsigned long _timeout_ms, const string& _cmd_name, TArgs&& ... _args) {
+        return caller->call_async(_timeout_ms, _cmd_name, std::forward<TArgs>(_args) ...);
+      }
+      template<typename ... TArgs>
+      void call_async(prpc::async_caller::callback_f _callback, unsigned long _timeout_ms, const string& _cmd_name, TArgs&& ... _args) {
+        caller->call_async(std::move(_callback), _timeout_ms, _cmd_name, std::forward<TArgs>(_args) ...);
+      }
+    };
   }
 }
@@ -47,6 +47,15 @@ namespace VIMR
     bool try_load_poses(const char* _filename);
     bool get_pose(Pose& _p_out);
     long long get_elapsed();
+    /*
+     * For apply_thread_config() (threads.hpp), the threads are only running after open()/play()
+     */
+    std::thread& get_play_thread() {
+      return play_thread;
+    }
+    std::thread& get_load_thread() {
+      return load_thread;
+    }
   protected:
     long long first_frame_timestamp = 0;
     long long playback_start_time = 0;
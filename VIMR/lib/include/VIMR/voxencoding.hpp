@@ -6,6 +6,7 @@
 #include <iomanip>
 #include <functional>
 #include <sstream>
+#include <cstring>
 
 namespace VIMR {
   class VIMR_INTERFACE VoxelEncoding : public Serializable {
@@ -88,5 +89,11 @@ namespace VIMR {
     T get_label(Voxel* _v) {
       return *reinterpret_cast<T*>(&_v->data[label_offset]);
     }
+    void set_label_bytes(Voxel* _v, const void* _l, size_t _n) const {
+      memcpy(&_v->data[label_offset], _l, _n);
+    }
+    void get_label_bytes(Voxel* _v, void* _l, size_t _n) const {
+      memcpy(_l, &_v->data[label_offset], _n);
+    }
   };
 }
\ No newline at end of file